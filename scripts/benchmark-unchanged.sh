@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# ./scripts/benchmark-unchanged.sh - this file is a part of program blocksync-fast
+
+# Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+
+#     http://www.apache.org/licenses/LICENSE-2.0
+
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Measures the per-block overhead of a sync where nothing has changed.
+# The src and dst are identical files in the page cache, so the time is spent
+# on hashing, comparing and the main loop rather than on the device.
+
+# Usage: benchmark-unchanged.sh [BINARY] [SIZE] [BLOCK_SIZE]
+
+BIN="${1:-blocksync-fast}"
+SIZE="${2:-1G}"
+BLOCK_SIZE="${3:-4K}"
+
+TMPDIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMPDIR"' EXIT
+
+SRC="$TMPDIR/src"
+DST="$TMPDIR/dst"
+DIGEST="$TMPDIR/digest"
+
+head -c "$SIZE" /dev/urandom >"$SRC" || exit 1
+cp "$SRC" "$DST"
+
+"$BIN" -s "$SRC" -d "$DST" -f "$DIGEST" -b "$BLOCK_SIZE" --silent || exit 1
+
+BYTES=$(stat -c %s "$SRC")
+BLOCKS=$((BYTES / $(numfmt --from=iec "$BLOCK_SIZE")))
+
+run() {
+    local name="$1"
+    shift
+
+    local start=$(date +%s%N)
+    "$BIN" "$@" -b "$BLOCK_SIZE" --silent || exit 1
+    local ns=$(($(date +%s%N) - start))
+
+    printf "%-22s %8d ms %12d blocks/s %8d ns/block\n" "$name" $((ns / 1000000)) $((BLOCKS * 1000000000 / ns)) $((ns / BLOCKS))
+}
+
+echo "Device size: $BYTES bytes, block size: $BLOCK_SIZE, $BLOCKS blocks"
+
+run "sync with digest" -s "$SRC" -d "$DST" -f "$DIGEST"
+run "sync without digest" -s "$SRC" -d "$DST"
+run "make delta" -s "$SRC" -f "$DIGEST" --make-delta -D "$TMPDIR/delta" --force
+run "make digest" -s "$SRC" --make-digest -f "$DIGEST"
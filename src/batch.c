@@ -0,0 +1,336 @@
+/*
+ ./src/batch.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "batch.h"
+#include "stats.h"
+#include "progress.h"
+
+#include <sys/wait.h>
+
+/*
+ --jobs-file syncs many volumes in one invocation. Every line of the file
+ holds 'SRC DST [DIGEST]' separated by whitespace, empty lines and lines
+ starting with '#' are skipped. The options given on the command line apply
+ to all volumes.
+
+ Each volume runs in a forked process, so it starts from the parsed options
+ and the fresh global state, and --jobs=N of them run at once. The volumes
+ share the --max-rate and --max-iops budget, report their counters through a
+ shared anonymous mapping and are printed as one summary at the end. SIGUSR1
+ prints the status of the whole batch.
+*/
+
+struct batch_volume
+{
+	char *src;
+	char *dst;
+	char *digest;
+	pid_t pid;
+};
+
+struct batch_stats
+{
+	bool done;
+	bool updated;
+	size_t wri_blocks;
+	size_t num_blocks;
+	size_t wri_bytes;
+	size_t data_size;
+};
+
+static struct batch
+{
+	struct batch_volume *volumes;
+	struct batch_stats *stats;
+	size_t num_volumes;
+	size_t started;
+	struct timespec start;
+} batch = {NULL, NULL, 0, 0, {0, 0}};
+
+static void batch_parse(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "%s: unable to open jobs file '%s': %s\n", process_name, path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t line_num = 0;
+	size_t max_volumes = 0;
+
+	while (getline(&line, &line_size, fp) >= 0)
+	{
+		char *save = NULL;
+		char *fields[4] = {NULL, NULL, NULL, NULL};
+		int num_fields = 0;
+
+		line_num++;
+
+		for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL && num_fields < 4; tok = strtok_r(NULL, " \t\r\n", &save))
+			fields[num_fields++] = tok;
+
+		if (num_fields == 0 || fields[0][0] == '#')
+			continue;
+
+		if (num_fields < 2 || num_fields > 3)
+		{
+			fprintf(stderr, "%s: line %zu of jobs file '%s' should be 'SRC DST [DIGEST]'\n", process_name, line_num, path);
+			free(line);
+			fclose(fp);
+			cleanup(EXIT_FAILURE);
+		}
+
+		if (batch.num_volumes == max_volumes)
+		{
+			max_volumes = MAX(max_volumes * 2, 16);
+			batch.volumes = realloc(batch.volumes, max_volumes * sizeof(struct batch_volume));
+
+			if (batch.volumes == NULL)
+			{
+				fprintf(stderr, "%s: unable to allocate memory for jobs file\n", process_name);
+				cleanup(EXIT_FAILURE);
+			}
+		}
+
+		struct batch_volume *vol = &batch.volumes[batch.num_volumes++];
+
+		vol->src = strdup(fields[0]);
+		vol->dst = strdup(fields[1]);
+		vol->digest = (fields[2] != NULL ? strdup(fields[2]) : NULL);
+		vol->pid = 0;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (batch.num_volumes == 0)
+	{
+		fprintf(stderr, "%s: jobs file '%s' has no volumes\n", process_name, path);
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+static void batch_volume(size_t i, void (*run)(void))
+{
+	src.path = batch.volumes[i].src;
+	dst.path = batch.volumes[i].dst;
+	digest.path = batch.volumes[i].digest;
+	param.jobs = 1;
+
+	/* the summary of a volume is dropped, stderr stays open for its errors */
+	if ((flag.prst = fopen("/dev/null", "w")) == NULL)
+		cleanup(EXIT_FAILURE);
+
+	progress_signal_init(SA_RESTART);
+
+	run();
+
+	batch.stats[i].updated = IS_MODE(dst.open_mode, READ) || IS_MODE(digest.open_mode, READ);
+	batch.stats[i].wri_blocks = prog.wri_blocks;
+	batch.stats[i].num_blocks = param.num_blocks;
+	batch.stats[i].wri_bytes = prog.wri_bytes;
+	batch.stats[i].data_size = param.data_size;
+	batch.stats[i].done = true;
+
+	cleanup(EXIT_SUCCESS);
+}
+
+/* prints the volumes finished so far and the running ones on SIGUSR1 */
+static void batch_print_status(void)
+{
+	size_t synced = 0, failed = 0, running = 0, wri_blocks = 0, wri_bytes = 0;
+	struct timespec now;
+
+	for (size_t i = 0; i < batch.started; i++)
+	{
+		const struct batch_stats *st = &batch.stats[i];
+
+		if (batch.volumes[i].pid != 0)
+			running++;
+		else if (st->done)
+			synced++;
+		else
+			failed++;
+
+		wri_blocks += st->wri_blocks;
+		wri_bytes += st->wri_bytes;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	fprintf(flag.prst, "Status: %zu/%zu volumes synced ", synced, batch.num_volumes);
+	fprintf(flag.prst, "(%zu changed blocks, %s written), ", wri_blocks, format_units(wri_bytes, false));
+	fprintf(flag.prst, "%zu running, %zu failed, %.1f s\n", running, failed, (now.tv_sec - batch.start.tv_sec) + (now.tv_nsec - batch.start.tv_nsec) / 1e9);
+	fflush(flag.prst);
+}
+
+static size_t batch_wait(void)
+{
+	int status = 0;
+	pid_t pid;
+
+	/* the handler of SIGUSR1 has no SA_RESTART in the batch process, so the signal interrupts wait() */
+	while ((pid = wait(&status)) < 0 && errno == EINTR)
+		if (progress_status_due())
+			batch_print_status();
+
+	for (size_t i = 0; i < batch.num_volumes; i++)
+	{
+		if (pid < 0 || batch.volumes[i].pid != pid)
+			continue;
+
+		struct batch_stats *st = &batch.stats[i];
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			st->done = false;
+
+		if (st->done)
+			fprintf(flag.prst, "Volume '%s' -> '%s': %s %zu/%zu blocks, %zu/%zu bytes.\n",
+					batch.volumes[i].src, batch.volumes[i].dst, st->updated ? "Updated" : "Copied",
+					st->wri_blocks, st->num_blocks, st->wri_bytes, st->data_size);
+		else
+			fprintf(flag.prst, "Volume '%s' -> '%s': failed\n", batch.volumes[i].src, batch.volumes[i].dst);
+
+		fflush(flag.prst);
+		batch.volumes[i].pid = 0;
+
+		return 1;
+	}
+
+	if (pid < 0)
+	{
+		fprintf(stderr, "%s: error while waiting for volumes: %s\n", process_name, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	return 0;
+}
+
+void batch_run(void (*run)(void))
+{
+	if (flag.silent && freopen("/dev/null", "w", flag.prst) == NULL)
+		cleanup(EXIT_FAILURE);
+
+	if (flag.oper_mode != BLOCKSYNC)
+	{
+		fprintf(stderr, "%s: --jobs-file works in block-sync mode only\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (param.changed_ranges != NULL)
+	{
+		fprintf(stderr, "%s: --changed-ranges can not be used with --jobs-file\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (param.jobs < 1 || param.jobs > MAX_JOBS)
+	{
+		fprintf(stderr, "%s: the number of jobs should be between 1 and %d\n", process_name, MAX_JOBS);
+		cleanup(EXIT_FAILURE);
+	}
+
+	batch_parse(param.jobs_file);
+
+	batch.stats = mmap(NULL, batch.num_volumes * sizeof(struct batch_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (batch.stats == MAP_FAILED)
+	{
+		batch.stats = NULL;
+		fprintf(stderr, "%s: unable to allocate memory for jobs file\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	memset(batch.stats, 0, batch.num_volumes * sizeof(struct batch_stats));
+
+	clock_gettime(CLOCK_MONOTONIC, &batch.start);
+	progress_signal_init(0);
+
+	fprintf(flag.prst, "Operation mode: block-sync of %zu volumes from '%s', %d at once\n", batch.num_volumes, param.jobs_file, param.jobs);
+	fflush(flag.prst);
+	fflush(stdout);
+	fflush(stderr);
+
+	size_t running = 0;
+
+	for (size_t next = 0; next < batch.num_volumes || running > 0;)
+	{
+		if (next < batch.num_volumes && running < (size_t)param.jobs)
+		{
+			pid_t pid = fork();
+
+			if (pid < 0)
+			{
+				fprintf(stderr, "%s: unable to start volume '%s': %s\n", process_name, batch.volumes[next].src, strerror(errno));
+				batch.started = ++next;
+				continue;
+			}
+
+			if (pid == 0)
+				batch_volume(next, run);
+
+			batch.volumes[next++].pid = pid;
+			batch.started = next;
+			running++;
+			continue;
+		}
+
+		running -= batch_wait();
+	}
+
+	size_t failed = 0, wri_blocks = 0, num_blocks = 0, wri_bytes = 0, data_size = 0;
+
+	for (size_t i = 0; i < batch.num_volumes; i++)
+	{
+		struct batch_stats *st = &batch.stats[i];
+
+		if (!st->done)
+			failed++;
+
+		wri_blocks += st->wri_blocks;
+		num_blocks += st->num_blocks;
+		wri_bytes += st->wri_bytes;
+		data_size += st->data_size;
+	}
+
+	fprintf(flag.prst, "Volumes: %zu synced, %zu failed, %zu/%zu blocks, %zu/%zu bytes.\n",
+			batch.num_volumes - failed, failed, wri_blocks, num_blocks, wri_bytes, data_size);
+
+	prog.wri_blocks = wri_blocks;
+	prog.wri_bytes = wri_bytes;
+	param.num_blocks = num_blocks;
+	param.data_size = data_size;
+	stats_print();
+
+	munmap(batch.stats, batch.num_volumes * sizeof(struct batch_stats));
+
+	for (size_t i = 0; i < batch.num_volumes; i++)
+	{
+		free(batch.volumes[i].src);
+		free(batch.volumes[i].dst);
+		free(batch.volumes[i].digest);
+	}
+
+	free(batch.volumes);
+
+	cleanup(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
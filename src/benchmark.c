@@ -36,6 +36,19 @@ void benchmark_hashes(void)
 		abort();
 	}
 
+	/* a whole default buffer of blocks for hash_blocks() */
+	size_t num_blocks = MAX(D_BUFFER_SIZE / param.block_size, 1);
+	char *blocks_data = malloc(num_blocks * param.block_size);
+
+	if (blocks_data == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for the test\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < num_blocks; i++)
+		memcpy(blocks_data + i * param.block_size, random_data, param.block_size);
+
 	int j = 0;
 
 	for (int i = -1; i <= 1024; i++)
@@ -56,9 +69,23 @@ void benchmark_hashes(void)
 			count++;
 		}
 
+		char *hashes = malloc(num_blocks * param.algo.size);
+
+		start_time = time(NULL);
+		size_t batch_count = 0;
+		while (hashes != NULL && time(NULL) - start_time < 1)
+		{
+			hash_blocks(param.algo.value, param.algo.library, param.algo.size, (void *)hashes, (const void *)blocks_data, param.block_size, num_blocks * param.block_size);
+			batch_count += num_blocks;
+		}
+
+		free(hashes);
 		hash_free(param.algo.value, param.algo.library, hash_buf);
 
 		if (i >= 0)
-			fprintf(flag.prst, "Algo: %-15s\tHash size: %3d bytes\t\tSpeed:%10d hashes/s\tProcessing: %10s/s\n", param.algo.symbol, param.algo.size, count, format_units(param.block_size * count, false));
+			fprintf(flag.prst, "Algo: %-15s\tHash size: %3d bytes\t\tSpeed:%10d hashes/s\tProcessing: %10s/s\tBatched: %10s/s\n", param.algo.symbol, param.algo.size, count,
+					format_units(param.block_size * count, false), format_units(param.block_size * batch_count, false));
 	}
+
+	free(blocks_data);
 }
\ No newline at end of file
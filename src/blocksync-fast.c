@@ -18,6 +18,26 @@
 
 #include "globals.h"
 #include "init.h"
+#include "hash_pool.h"
+#include "uring.h"
+#include "readahead.h"
+#include "sparse.h"
+#include "digest_tree.h"
+#include "compress.h"
+#include "jobs.h"
+#include "batch.h"
+#include "throttle.h"
+#include "checkpoint.h"
+#include "zero_copy.h"
+#include "compare.h"
+#include "remote.h"
+#include "digest_cache.h"
+#include "coarse.h"
+#include "copy_range.h"
+#include "changed_ranges.h"
+#include "sectors.h"
+#include "stats.h"
+#include "progress.h"
 
 void print_version(void)
 {
@@ -69,6 +89,26 @@ void print_help(void)
 					   "  Digest file stores checksums of the blocks from sync\n"
 					   "\n"
 
+					   "--digest-cache=DIR\n"
+					   "  Keeps the digest of a block-sync without -f in DIR, named after the target device\n"
+					   "  and size, and uses it while the target times, inode and size are unchanged\n"
+					   "\n"
+
+					   "--digest-cache-blkdev\n"
+					   "  Uses the digest cache also for a block device target, whose times do not change\n"
+					   "  on writes. Only safe when nothing but block-sync writes the target\n"
+					   "\n"
+
+					   "--digest-tree\n"
+					   "  Appends hashes of 1M, 64M and 4G ranges to the digest file, so digests can be\n"
+					   "  compared top-down. Older versions reject such digest\n"
+					   "\n"
+
+					   "--digest-coarse\n"
+					   "  Appends hashes of whole 1M ranges to the digest file, the blocks of unchanged\n"
+					   "  ranges are not hashed one by one. Older versions reject such digest\n"
+					   "\n"
+
 					   "--make-delta\n"
 					   "  Creates a delta file from src\n"
 					   "\n"
@@ -81,6 +121,17 @@ void print_help(void)
 					   "  Delta file path. If none, data write to stdout or read from stdin\n"
 					   "\n"
 
+					   "--compress=ALGO[:LEVEL]\n"
+					   "  Compress the delta made by --make-delta with zstd or lz4 in frames on a worker\n"
+					   "  thread, --apply-delta and --delta-info detect the compression automatically\n"
+					   "\n"
+
+					   "--delta-format=FORMAT\n"
+					   "  Records of the delta made by --make-delta: blocks, one per changed block, readable\n"
+					   "  by older versions, or extents, one per run of changed blocks. --compress and\n"
+					   "  --sparse always use extents (default: blocks)\n"
+					   "\n"
+
 					   "-b, --block-size=N[KMG]\n"
 					   "  Block size in N bytes for writing and checksum calculations\n"
 					   "  (default:4K)\n"
@@ -95,6 +146,59 @@ void print_help(void)
 #endif
 					   "\n"
 
+					   "--threads=N\n"
+					   "  Number of threads used to compute checksums of the blocks loaded into the buffer\n"
+					   "  (default:1)\n"
+					   "\n"
+
+					   "--jobs=N\n"
+					   "  Number of processes which sync or digest separate ranges of the device at once,\n"
+					   "  with --jobs-file the number of volumes synced at once (default:1)\n"
+					   "\n"
+
+					   "--jobs-file=PATH\n"
+					   "  Syncs every 'SRC DST [DIGEST]' line of the file with the given options and prints\n"
+					   "  one summary of all volumes\n"
+					   "\n"
+
+					   "--max-rate=N[KMG]\n"
+					   "  Limits reads and writes of all jobs and volumes together to N bytes per second\n"
+					   "\n"
+
+					   "--max-iops=N\n"
+					   "  Limits buffer loads and writes of all jobs and volumes together to N per second\n"
+					   "\n"
+
+					   "--remote=CMD\n"
+					   "  Syncs src to a target of the program started by CMD with --server, e.g.\n"
+					   "  'ssh HOST blocksync-fast --server -d DST', only changed blocks are sent\n"
+					   "\n"
+
+					   "--changed-ranges=FILE\n"
+					   "  Processes only the ranges of the device listed in FILE as 'OFFSET LENGTH' lines\n"
+					   "  or binary uint64_t pairs, the digest keeps the hashes of the other blocks\n"
+					   "\n"
+
+					   "--sector-writes=N[K]\n"
+					   "  Writes only the N-byte sectors of changed blocks which differ from the target,\n"
+					   "  with a digest the changed blocks are read from the target (default: 4K without digest)\n"
+					   "\n"
+
+					   "--server\n"
+					   "  Receives a block-sync from --remote over stdin and stdout and writes it to dst\n"
+					   "\n"
+
+					   "--stats=json[:FILE]\n"
+					   "  Prints or writes to FILE the time, CPU time and bytes of the read, hash, compare,\n"
+					   "  write and sync phases and the calls per device as JSON at the end of the run,\n"
+					   "  without FILE the JSON goes to stdout and the summary to stderr\n"
+					   "\n"
+
+					   "--latency[=buckets]\n"
+					   "  Prints p50, p99, p99.9 and max latency of the read, write and sync calls per device\n"
+					   "  at the end of the run, with buckets also the counts of the histogram buckets\n"
+					   "\n"
+
 					   "-l, --list-algos\n"
 					   "  It prints all supported hash algorithms\n"
 					   "\n"
@@ -111,27 +215,63 @@ void print_help(void)
 					   "  Checks delta file, prints info and exit\n"
 					   "\n"
 
+					   "--compare-digests A B\n"
+					   "  Compares two digest files of one device and prints the ranges of the differing\n"
+					   "  blocks as 'OFFSET LENGTH' lines, as read by --changed-ranges\n"
+					   "\n"
+
 					   "--buffer-size=N[KMG]\n"
 					   "  Size of the buffer in N bytes for processing data per device\n"
 					   "  (default:2M)\n"
 					   "\n"
 
 					   "--progress, --show-progress\n"
-					   "  Show current progress while syncing\n"
+					   "  Show current progress, throughput and ETA once a second while syncing,\n"
+					   "  SIGUSR1 prints a status line also without this option\n"
 					   "\n"
 
 					   "--progress-detail, --show-progress-detail\n"
-					   "  Show more detailed progress which generates a lot of writes on the console\n"
+					   "  Show the states of the blocks in a row refreshed once a second, a new row is\n"
+					   "  started when they change\n"
 					   "\n"
 
 					   "--mmap\n"
 					   "  Use a system mmap instead of direct read and write method\n"
 					   "\n"
 
+					   "--io-uring\n"
+					   "  Use io_uring to keep several reads and writes in flight instead of direct read and write method\n"
+					   "\n"
+
+					   "--queue-depth=N\n"
+					   "  Maximum number of io_uring requests in flight\n"
+					   "  (default:16)\n"
+					   "\n"
+
+					   "--read-ahead=N\n"
+					   "  Use a ring of N buffers per device filled by a reader thread, while a writer thread\n"
+					   "  drains changed blocks, so reading, hashing and writing overlap\n"
+					   "\n"
+
+					   "--direct-io\n"
+					   "  Open src and dst devices with O_DIRECT to bypass the page cache, the unaligned\n"
+					   "  tail block is written through the page cache\n"
+					   "\n"
+
+					   "--sparse\n"
+					   "  Skip reading holes of a sparse source file and punch zero blocks out of the\n"
+					   "  target instead of writing them\n"
+					   "\n"
+
 					   "--no-compare\n"
 					   "  Copy all data from src to dst without comparing differences\n"
 					   "\n"
 
+					   "--resume\n"
+					   "  Continues an interrupted block-sync or make-delta from the checkpoint which is\n"
+					   "  stored in the digest file every 30 seconds\n"
+					   "\n"
+
 					   "--sync-writes\n"
 					   "  Immediately flushes and writes data to the disk specified at --buffer-size\n"
 					   "\n"
@@ -186,76 +326,27 @@ void print_algos(void)
 	}
 }
 
-void print_progress(void)
-{
-	prog.c_per = floor((((float)(oper.num_block + 1) / (float)param.num_blocks) * 100) * param.pro_fact) / param.pro_fact;
-
-	if (prog.p_per != prog.c_per || oper.num_block < 1) {
-		fprintf(flag.prst, param.pro_form, prog.c_per);
-		fflush(stdout);		
-	}
-
-	prog.p_per = prog.c_per;
-}
-
-void print_detail_progress_row(size_t cur_block, size_t num_blocks, bool dig_mat, bool dig_wri, bool dst_mat, bool dst_wri)
-{
-	bool target_write = false;
-	bool target_match = false;
-
-	if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == APPLYDELTA)
-		target_write = true;
-
-	if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == MAKEDELTA)
-		target_match = true;
-
-	fprintf(flag.prst, "\33[2K\r");
-	fprintf(flag.prst, "\rBlock: %10zu/%zu"
-					   "%s"
-					   "%s"
-					   "%s"
-					   "%s",
-			cur_block,
-			num_blocks,
-			(dig_mat ? "\tDigest:Match" : ""),
-			(dig_wri ? "\tDigest:Write" : ""),
-			(dst_mat ? (target_match ? "\tTarget:Match" : "\tTarget:Seek") : ""),
-			(dst_wri ? (target_write ? "\tTarget:Write" : "\tDelta:Write") : ""));
-
-	fflush(stdout);
-}
-
-void print_detail_progress(void)
-{
-	bool p_c = ((prog.p_dst_wri != prog.c_dst_wri || prog.p_dig_wri != prog.c_dig_wri || prog.p_dig_mat != prog.c_dig_mat || prog.p_dst_mat != prog.c_dst_mat) && (prog.p_dst_wri || prog.p_dig_wri || prog.p_dig_mat || prog.p_dst_mat) ? true : false);
-
-	if (prog.p_per != prog.c_per || p_c)
-		print_detail_progress_row((oper.num_block), param.num_blocks, prog.p_dig_mat, prog.p_dig_wri, prog.p_dst_mat, prog.p_dst_wri);
-
-	prog.c_per = (((float)(oper.num_block + 1) / (float)param.num_blocks) * 100);
-
-	if (oper.num_block > 0 && p_c)
-		fprintf(flag.prst, "\n");
-
-	if (prog.p_per != prog.c_per || p_c)
-		print_detail_progress_row((oper.num_block + 1), param.num_blocks, prog.c_dig_mat, prog.c_dig_wri, prog.c_dst_mat, prog.c_dst_wri);
-
-	prog.p_dst_wri = prog.c_dst_wri;
-	prog.p_dig_wri = prog.c_dig_wri;
-	prog.p_dig_mat = prog.c_dig_mat;
-	prog.p_dst_mat = prog.c_dst_mat;
-	prog.p_per = prog.c_per;
-}
-
 void print_summary(void)
 {
 	if (flag.progress > 0)
+	{
+		progress_finish();
 		fprintf(flag.prst, "\n");
+	}
 
 	fprintf(flag.prst, "%s: %zu/%zu blocks, %zu/%zu bytes.\n",
 			flag.oper_mode == MAKEDIGEST ? (IS_MODE(digest.open_mode, READ) ? "Updated" : "Created") : (IS_MODE(dst.open_mode, READ) ? "Updated" : "Copied"),
 			prog.wri_blocks, param.num_blocks, prog.wri_bytes, param.data_size);
 
+	readahead_print_stats();
+	sparse_print_stats();
+	compress_print_stats();
+	zero_copy_print_stats();
+	coarse_print_stats();
+	copy_range_print_stats();
+	sectors_print_stats();
+	remote_print_stats();
+
 	if ( flag.oper_mode == BLOCKSYNC && IS_MODE(src.open_mode, PIPE_R) ) {
 	
 		if (param.data_size > src.data_size) {
@@ -269,6 +360,8 @@ void print_summary(void)
 				fprintf(flag.prst, "Warning: additional data found in STDIN. Data has been truncated to the specified --size.\n");
 		}
 	}
+
+	stats_print();
 }
 
 void parse_options(int argc, char **argv)
@@ -284,7 +377,15 @@ void parse_options(int argc, char **argv)
 		{"silent", no_argument, &flag.silent, 1},
 		{"force", no_argument, &flag.force, 1},
 		{"mmap", no_argument, &flag.mmap, 1},
+		{"io-uring", no_argument, &flag.io_uring, 1},
+		{"direct-io", no_argument, &flag.direct_io, 1},
+		{"sparse", no_argument, &flag.sparse, 1},
+		{"digest-tree", no_argument, &flag.digest_tree, 1},
+		{"digest-coarse", no_argument, &flag.digest_coarse, 1},
+		{"digest-cache-blkdev", no_argument, &flag.digest_cache_blkdev, 1},
 		{"no-compare", no_argument, &flag.no_compare, 1},
+		{"resume", no_argument, &flag.resume, 1},
+		{"server", no_argument, &flag.server, 1},
 		{"sync-writes", no_argument, &flag.write_sync, 1},
 		{"dont-write", no_argument, &flag.dont_write, 3},		 //(11)
 		{"dont-write-target", no_argument, &flag.dont_write, 2}, //(10)
@@ -294,7 +395,23 @@ void parse_options(int argc, char **argv)
 		{"size", required_argument,	0, 'S'},
 		{"digest", required_argument, 0, 'f'},
 		{"delta", required_argument, 0, 'D'},
+		{"compress", required_argument, 0, 1005},
 		{"buffer-size", required_argument, 0, 1001},
+		{"threads", required_argument, 0, 1002},
+		{"queue-depth", required_argument, 0, 1003},
+		{"read-ahead", required_argument, 0, 1004},
+		{"jobs", required_argument, 0, 1006},
+		{"jobs-file", required_argument, 0, 1007},
+		{"max-rate", required_argument, 0, 1008},
+		{"max-iops", required_argument, 0, 1009},
+		{"remote", required_argument, 0, 1010},
+		{"digest-cache", required_argument, 0, 1011},
+		{"changed-ranges", required_argument, 0, 1012},
+		{"sector-writes", required_argument, 0, 1013},
+		{"compare-digests", required_argument, 0, 1014},
+		{"stats", required_argument, 0, 1015},
+		{"latency", optional_argument, 0, 1016},
+		{"delta-format", required_argument, 0, 1017},
 		{"block-size", required_argument, 0, 'b'},
 		{"algo", required_argument, 0, 'a'},
 		{"list-algos", no_argument, 0, 'l'},
@@ -345,6 +462,71 @@ void parse_options(int argc, char **argv)
 		case 1001:
 			param.max_buf_size = parse_units(optarg);
 			break;
+		case 1002:
+			param.threads = atoi(optarg);
+			break;
+		case 1003:
+			param.queue_depth = atoi(optarg);
+			break;
+		case 1004:
+			param.read_ahead = atoi(optarg);
+			break;
+		case 1005:
+			codec_parse(optarg);
+			break;
+		case 1006:
+			param.jobs = atoi(optarg);
+			break;
+		case 1007:
+			param.jobs_file = optarg;
+			break;
+		case 1008:
+			param.max_rate = parse_units(optarg);
+			break;
+		case 1009:
+			param.max_iops = atoi(optarg);
+			break;
+		case 1010:
+			param.remote = optarg;
+			break;
+		case 1011:
+			param.digest_cache = optarg;
+			break;
+		case 1012:
+			param.changed_ranges = optarg;
+			break;
+		case 1013:
+			param.sector_size = parse_units(optarg);
+			break;
+		case 1014:
+			flag.oper_mode = COMPAREDIGESTS;
+			param.compare_digests[0] = optarg;
+			break;
+		case 1015:
+			param.stats = optarg;
+			break;
+		case 1016:
+			if (optarg == NULL)
+				param.latency = 1;
+			else if (strcmp(optarg, "buckets") == 0)
+				param.latency = 2;
+			else
+			{
+				fprintf(stderr, "%s: unsupported latency option '%s', only buckets is supported\n", process_name, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 1017:
+			if (strcmp(optarg, "blocks") == 0)
+				param.delta_format = DELTA_BLOCKS;
+			else if (strcmp(optarg, "extents") == 0)
+				param.delta_format = DELTA_EXTENTS;
+			else
+			{
+				fprintf(stderr, "%s: unsupported delta format '%s', use blocks or extents\n", process_name, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'l':
 			print_algos();
 			exit(EXIT_SUCCESS);
@@ -368,27 +550,58 @@ void parse_options(int argc, char **argv)
 			break;
 		}
 	}
+
+	/* the second digest of --compare-digests A B is the first operand */
+	if (flag.oper_mode == COMPAREDIGESTS && optind < argc)
+		param.compare_digests[1] = argv[optind];
+}
+
+/* accounts the unchanged blocks that follow the current one as processed and returns their number */
+size_t pass_clean_run(void)
+{
+	size_t clean_blocks = compare_clean_run(&src);
+
+	if (flag.digest_tree == 1)
+		for (size_t i = 1; i <= clean_blocks; i++)
+			digest_tree_add((const void *)(digest.ptr_r + i * digest.block_size));
+
+	oper.num_block += clean_blocks;
+
+	return clean_blocks;
 }
 
 void blocksync(void)
 {
+	bool src_zero = false;
 	size_t dev_flush = 0;
 	size_t digest_flush = 0;
 	bool dev_reload = false;
 	bool digest_reload = false;
+	bool checkpoint = false;
 
-	while (src.abs_off < src.data_size)
+	while (src.abs_off < src.data_size || changed_ranges_left())
 	{
+		/* the pending writes of a finished changed range are flushed before the next one is loaded */
+		if (src.abs_off >= src.data_size)
+		{
+			blocksync_dev_wri_flush(dev_flush);
+			digest_wri_flush(digest_flush);
+			dev_flush = digest_flush = 0;
+			changed_ranges_next();
+		}
+
 		if ((src.abs_off + src.block_size) > src.data_size)
 			dst.block_size = src.block_size = src.data_size % src.block_size;
 
 		dev_reload = check_buffer_reload(&src);
 		digest_reload = check_buffer_reload(&digest);
+		/* a checkpoint is saved after all pending writes are flushed */
+		checkpoint = (dev_reload || digest_reload) && checkpoint_due();
 
-		if (dev_flush > 0 || dev_reload)
+		if (dev_flush > 0 || dev_reload || checkpoint)
 			blocksync_dev_wri_flush(dev_flush);
 
-		if (digest_flush > 0 || digest_reload)
+		if (digest_flush > 0 || digest_reload || checkpoint)
 			digest_wri_flush(digest_flush);
 
 		if (dev_reload || digest_reload)
@@ -397,15 +610,26 @@ void blocksync(void)
 			sync_data(&digest);
 		}
 
+		if (checkpoint)
+		{
+			sparse_flush();
+			checkpoint_save();
+		}
+
 		if (dev_reload)
 		{
-			map_buffer(&src);
-			map_buffer(&dst);
+			map_buffers(&src, &dst);
+
+			if (param.hash_use)
+				hash_pool_run(&src);
 		}
 
 		if (IS_MODE(digest.open_mode, WRITE) && digest_reload)
 			map_buffer(&digest);
 
+		if (dev_reload || digest_reload)
+			compare_run(&src, &dst, &digest);
+
 		get_ptr(&src);
 		get_ptr(&dst);
 		get_ptr(&digest);
@@ -422,25 +646,38 @@ void blocksync(void)
 		digest_flush = 0;
 		dev_flush = 0;
 
-		if (param.hash_use)
-			hash_buffer(param.algo.value, param.algo.library, param.algo.size, (void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), src.ptr_r, src.block_size);
+		src_zero = flag.sparse == 1 && buffer_is_zero(src.ptr_r, src.block_size);
+
+		if (param.hash_use && src_zero)
+			sparse_zero_hash((void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), src.block_size);
+		else if (param.hash_use)
+			memcpy((void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), hash_pool_get(&src), param.algo.size);
+
+		if (flag.digest_tree == 1)
+			digest_tree_add((const void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)));
 
 		if (IS_MODE(digest.open_mode, READ))
 		{
-			if (memcmp(digest.ptr_r, (const void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), param.algo.size) == 0)
+			if (!compare_dirty(&src))
 			{
 				prog.c_dst_wri = false;
 				prog.c_dig_wri = false;
 				prog.c_dig_mat = true;
 			}
 		}
-		else if (IS_MODE(dst.open_mode, READ) && (memcmp(dst.ptr_r, src.ptr_r, src.block_size) == 0))
+		else if (IS_MODE(dst.open_mode, READ) && !compare_dirty(&src))
 		{
 			prog.c_dst_wri = false;
 			prog.c_dst_mat = true;
 		}
 
-		if (prog.c_dst_wri)
+		if (prog.c_dst_wri && src_zero && sparse_zero(&dst, dst.abs_off, src.block_size))
+		{
+			prog.wri_blocks++;
+			prog.wri_bytes += src.block_size;
+			dev_flush = src.block_size;
+		}
+		else if (prog.c_dst_wri)
 		{
 			prog.wri_blocks++;
 			prog.wri_bytes += src.block_size;
@@ -449,57 +686,93 @@ void blocksync(void)
 		else
 			dev_flush = src.block_size;
 
+		/* the unchanged blocks that follow in the compared window are passed as one run */
+		size_t clean_blocks = 0;
+
+		if (prog.c_dig_mat || (prog.c_dst_mat && !param.hash_use))
+			clean_blocks = pass_clean_run();
+
+		dev_flush += clean_blocks * src.block_size;
+
 		if (prog.c_dig_wri)
 			oper.digest_wri_buf_size += digest.block_size;
 		else
-			digest_flush = digest.block_size;
+			digest_flush = (clean_blocks + 1) * digest.block_size;
 
 		if (flag.progress > 1)
 			print_detail_progress();
-		else if (flag.progress == 1)
+		else if (progress_due)
 			print_progress();
 
-		dst.abs_off = src.abs_off += src.block_size;
-		dst.rel_off = src.rel_off += src.block_size;
+		dst.abs_off = src.abs_off += (clean_blocks + 1) * src.block_size;
+		dst.rel_off = src.rel_off += (clean_blocks + 1) * src.block_size;
 
-		digest.abs_off += digest.block_size;
-		digest.rel_off += digest.block_size;
+		digest.abs_off += (clean_blocks + 1) * digest.block_size;
+		digest.rel_off += (clean_blocks + 1) * digest.block_size;
 
 		oper.num_block++;
 	}
 
-	blocksync_dev_wri_flush(0);
-	digest_wri_flush(0);
+	blocksync_dev_wri_flush(dev_flush);
+	digest_wri_flush(digest_flush);
+	sparse_flush();
+	checkpoint_clear();
+
+	if (flag.digest_tree == 1)
+		digest_tree_write();
+
+	readahead_drain();
 }
 
 void make_delta(void)
 {
+	bool src_zero = false;
 	size_t digest_flush = 0;
 	bool dev_reload = false;
 	bool digest_reload = false;
 	bool delta_reload = false;
+	bool checkpoint = false;
+	off_t extent_end = -1;
+	size_t extent_pos = 0;
+	bool extent_zero = false;
+	bool extents = delta_header.format == DELTA_EXTENTS;
 
-	while (src.abs_off < src.data_size)
+	while (src.abs_off < src.data_size || changed_ranges_left())
 	{
+		if (src.abs_off >= src.data_size)
+		{
+			digest_wri_flush(digest_flush);
+			digest_flush = 0;
+			changed_ranges_next();
+		}
+
 		if ((src.abs_off + src.block_size) > src.data_size)
 		{
 			src.block_size = src.data_size % src.block_size;
-			delta.block_size = sizeof(u_int64_t) + src.block_size;
+			delta.block_size = 2 * sizeof(uint64_t) + src.block_size;
 		}
 
 		dev_reload = check_buffer_reload(&src);
 		digest_reload = check_buffer_reload(&digest);
-		delta_reload = check_buffer_reload(&delta);
+		/* records have variable sizes, so the buffer is reloaded when the largest one does not fit */
+		delta_reload = check_buffer_reload(&delta) || (size_t)delta.rel_off + delta.block_size > delta.buf_size;
+		/* a checkpoint reloads the delta buffer too, which writes it out and closes the open extent */
+		checkpoint = (dev_reload || digest_reload || delta_reload) && checkpoint_due();
+		delta_reload = delta_reload || checkpoint;
 
-		if (digest_flush > 0 || digest_reload)
+		if (digest_flush > 0 || digest_reload || checkpoint)
 			digest_wri_flush(digest_flush);
 
 		if (delta_reload)
 		{
 			delta.data_size = delta.abs_off + delta.max_buf_size;
-			dev_truncate(&delta);
+
+			if (delta.codec == CODEC_NONE)
+				dev_truncate(&delta);
+
 			makedelta_wri_flush_buf();
 			map_buffer(&delta);
+			extent_end = -1;
 		}
 
 		if (digest_reload || delta_reload)
@@ -508,12 +781,23 @@ void make_delta(void)
 			sync_data(&delta);
 		}
 
+		if (checkpoint)
+			checkpoint_save();
+
 		if (dev_reload)
+		{
 			map_buffer(&src);
 
+			if (param.hash_use)
+				hash_pool_run(&src);
+		}
+
 		if (IS_MODE(digest.open_mode, WRITE) && digest_reload)
 			map_buffer(&digest);
 
+		if (dev_reload || digest_reload)
+			compare_run(&src, &dst, &digest);
+
 		get_ptr(&src);
 		get_ptr(&digest);
 
@@ -527,12 +811,19 @@ void make_delta(void)
 
 		digest_flush = 0;
 
-		if (param.hash_use)
-			hash_buffer(param.algo.value, param.algo.library, param.algo.size, (void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), src.ptr_r, src.block_size);
+		src_zero = flag.sparse == 1 && buffer_is_zero(src.ptr_r, src.block_size);
+
+		if (param.hash_use && src_zero)
+			sparse_zero_hash((void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), src.block_size);
+		else if (param.hash_use)
+			memcpy((void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), hash_pool_get(&src), param.algo.size);
+
+		if (flag.digest_tree == 1)
+			digest_tree_add((const void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)));
 
 		if (IS_MODE(digest.open_mode, READ))
 		{
-			if (memcmp(digest.ptr_r, (const void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), param.algo.size) == 0)
+			if (!compare_dirty(&src))
 			{
 				prog.c_dst_wri = false;
 				prog.c_dig_wri = false;
@@ -546,41 +837,83 @@ void make_delta(void)
 			prog.wri_bytes += src.block_size;
 			oper.dev_wri_buf_size += src.block_size;
 
-			memcpy((void *)(oper.delta_buf + oper.delta_wri_buf_size), (uint64_t *)&src.abs_off, sizeof(uint64_t));
-			memcpy((void *)(oper.delta_buf + oper.delta_wri_buf_size + sizeof(uint64_t)), (const void *)src.ptr_r, src.block_size);
-			oper.delta_wri_buf_size += delta.block_size;
+			/* zero blocks go to zero extents, which have no data */
+			bool zero = src_zero && extents;
+			size_t data_size = zero ? 0 : src.block_size;
+			size_t record_size = data_size;
 
-			delta.abs_off += delta.block_size;
-			delta.rel_off += delta.block_size;
+			if (!extents)
+			{
+				memcpy((void *)(oper.delta_buf + oper.delta_wri_buf_size), (uint64_t *)&src.abs_off, sizeof(uint64_t));
+				record_size += sizeof(uint64_t);
+			}
+			else if (src.abs_off != extent_end || zero != extent_zero)
+			{
+				uint64_t extent[2] = {src.abs_off, zero ? DELTA_ZERO : 0};
+
+				extent_pos = oper.delta_wri_buf_size;
+				memcpy((void *)(oper.delta_buf + extent_pos), (const void *)extent, sizeof(extent));
+				record_size += sizeof(extent);
+			}
+
+			if (extents)
+			{
+				uint64_t extent_len;
+				memcpy(&extent_len, (const void *)(oper.delta_buf + extent_pos + sizeof(uint64_t)), sizeof(uint64_t));
+				extent_len += src.block_size;
+				memcpy((void *)(oper.delta_buf + extent_pos + sizeof(uint64_t)), &extent_len, sizeof(uint64_t));
+			}
+
+			memcpy((void *)(oper.delta_buf + oper.delta_wri_buf_size + (record_size - data_size)), (const void *)src.ptr_r, data_size);
+			oper.delta_wri_buf_size += record_size;
+			extent_end = src.abs_off + src.block_size;
+			extent_zero = zero;
+
+			delta.abs_off += record_size;
+			delta.rel_off += record_size;
 		}
 
+		/* the unchanged blocks that follow in the compared window are passed as one run */
+		size_t clean_blocks = 0;
+
+		if (prog.c_dig_mat)
+			clean_blocks = pass_clean_run();
+
 		if (prog.c_dig_wri)
 			oper.digest_wri_buf_size += digest.block_size;
 		else
-			digest_flush = digest.block_size;
+			digest_flush = (clean_blocks + 1) * digest.block_size;
 
 		if (flag.progress > 1)
 			print_detail_progress();
-		else if (flag.progress == 1)
+		else if (progress_due)
 			print_progress();
 
-		digest.abs_off += digest.block_size;
-		digest.rel_off += digest.block_size;
+		digest.abs_off += (clean_blocks + 1) * digest.block_size;
+		digest.rel_off += (clean_blocks + 1) * digest.block_size;
 
-		src.abs_off += src.block_size;
-		src.rel_off += src.block_size;
+		src.abs_off += (clean_blocks + 1) * src.block_size;
+		src.rel_off += (clean_blocks + 1) * src.block_size;
 
 		oper.num_block++;
 	}
 
-	digest_wri_flush(0);
+	digest_wri_flush(digest_flush);
 	makedelta_wri_flush_buf();
+	checkpoint_clear();
+
+	if (flag.digest_tree == 1)
+		digest_tree_write();
 
 	delta.data_size = delta.abs_off;
+
+	if (delta.codec != CODEC_NONE)
+		compress_finish(&delta);
+
 	dev_truncate(&delta);
 }
 
-void apply_delta(void)
+void apply_delta_blocks(void)
 {
 	off_t cur_block_off = 0;
 	off_t prev_block_off = 0;
@@ -606,7 +939,7 @@ void apply_delta(void)
 			oper.num_block = (prev_block_off) / param.block_size + 1;
 			if (flag.progress > 1)
 				print_detail_progress();
-			else if (flag.progress == 1)
+			else if (progress_due)
 				print_progress();
 
 			applydelta_wri_flush_buf(dst.block_size);
@@ -640,13 +973,145 @@ void apply_delta(void)
 
 		if (flag.progress > 1)
 			print_detail_progress();
-		else if (flag.progress == 1)
+		else if (progress_due)
 			print_progress();
 
 		delta.abs_off += delta.block_size;
 		delta.rel_off += delta.block_size;
 	}
 
+	applydelta_wri_flush_buf(dst.block_size);
+}
+
+/* returns the number of bytes left in the loaded delta buffer, loads the next one when it is used up */
+size_t delta_avail(void)
+{
+	if ((size_t)delta.abs_off >= delta.data_size)
+		return 0;
+
+	if (delta.abs_off >= delta.buf_off)
+	{
+		sync_data(&dst);
+		map_buffer(&delta);
+	}
+
+	get_ptr(&delta);
+
+	return delta.buf_size - delta.rel_off;
+}
+
+void delta_skip(size_t size)
+{
+	delta.abs_off += size;
+	delta.rel_off += size;
+}
+
+/* reads the next extent header, which may be split between two loaded buffers */
+bool delta_read_extent(uint64_t *extent)
+{
+	size_t extent_size = 2 * sizeof(uint64_t);
+
+	if (zero_copy_active())
+		return zero_copy_read(extent, extent_size);
+
+	if (delta_avail() == 0)
+		return false;
+
+	for (size_t pos = 0, size; pos < extent_size; pos += size)
+	{
+		size = MIN(extent_size - pos, delta_avail());
+
+		if (size == 0)
+		{
+			fprintf(stderr, "%s: delta data is invalid\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+
+		memcpy((char *)extent + pos, delta.ptr_r, size);
+		delta_skip(size);
+	}
+
+	return true;
+}
+
+void apply_delta_extents(void)
+{
+	uint64_t extent[2];
+	off_t prev_end = 0;
+
+	while (delta_read_extent(extent))
+	{
+		off_t off = extent[0];
+		size_t len = extent[1] & ~DELTA_ZERO;
+		bool zero = (extent[1] & DELTA_ZERO) != 0;
+
+		if (len == 0 || extent[0] > dst.data_size || len > dst.data_size - extent[0] || off < prev_end)
+		{
+			fprintf(stderr, "%s: delta data is invalid\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+
+		if (off > prev_end)
+		{
+			prog.c_dst_wri = false;
+			prog.c_dst_mat = true;
+			oper.num_block = prev_end / param.block_size;
+
+			if (flag.progress > 1)
+				print_detail_progress();
+			else if (progress_due)
+				print_progress();
+		}
+
+		prog.wri_blocks += (len + param.block_size - 1) / param.block_size;
+		prog.wri_bytes += len;
+		prev_end = off + len;
+
+		/* the payload is moved by the kernel or written straight from the delta buffer, once per loaded part */
+		if (zero)
+			sparse_apply_zero(off, len);
+		else if (zero_copy_active())
+			zero_copy_write(off, len);
+		else
+			while (len > 0)
+			{
+				size_t size = MIN(len, delta_avail());
+
+				if (size == 0)
+				{
+					fprintf(stderr, "%s: delta data is invalid\n", process_name);
+					cleanup(EXIT_FAILURE);
+				}
+
+				applydelta_wri_extent(delta.ptr_r, size, off);
+				delta_skip(size);
+
+				off += size;
+				len -= size;
+			}
+
+		prog.c_dst_wri = true;
+		prog.c_dst_mat = false;
+		oper.num_block = (prev_end - 1) / param.block_size;
+
+		if (flag.progress > 1)
+			print_detail_progress();
+		else if (progress_due)
+			print_progress();
+	}
+
+	sparse_flush();
+	uring_wait();
+	sync_data(&dst);
+}
+
+void apply_delta(void)
+{
+	if (delta_header.format == DELTA_EXTENTS)
+		apply_delta_extents();
+	else
+		apply_delta_blocks();
+
 	prog.c_dst_wri = false;
 	prog.c_dst_mat = true;
 
@@ -656,7 +1121,7 @@ void apply_delta(void)
 
 		if (flag.progress > 1)
 			print_detail_progress();
-		else if (flag.progress == 1)
+		else if (progress_due)
 			print_progress();
 	}
 
@@ -666,21 +1131,27 @@ void apply_delta(void)
 
 		if (flag.progress > 1)
 			print_detail_progress();
-		else if (flag.progress == 1)
+		else if (progress_due)
 			print_progress();
 	}
-
-	applydelta_wri_flush_buf(dst.block_size);
 }
 
 void make_digest(void)
 {
+	bool src_zero = false;
 	size_t digest_flush = 0;
 	bool dev_reload = false;
 	bool digest_reload = false;
 
-	while (src.abs_off < src.data_size)
+	while (src.abs_off < src.data_size || changed_ranges_left())
 	{
+		if (src.abs_off >= src.data_size)
+		{
+			digest_wri_flush(digest_flush);
+			digest_flush = 0;
+			changed_ranges_next();
+		}
+
 		if ((src.abs_off + src.block_size) > src.data_size)
 			src.block_size = src.data_size % src.block_size;
 
@@ -694,11 +1165,19 @@ void make_digest(void)
 			sync_data(&digest);
 
 		if (dev_reload)
+		{
 			map_buffer(&src);
 
+			if (param.hash_use)
+				hash_pool_run(&src);
+		}
+
 		if (digest_reload)
 			map_buffer(&digest);
 
+		if (dev_reload || digest_reload)
+			compare_run(&src, &dst, &digest);
+
 		get_ptr(&src);
 		get_ptr(&digest);
 
@@ -707,18 +1186,31 @@ void make_digest(void)
 
 		digest_flush = 0;
 
-		if (param.hash_use)
-			hash_buffer(param.algo.value, param.algo.library, param.algo.size, (void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), src.ptr_r, src.block_size);
+		src_zero = flag.sparse == 1 && buffer_is_zero(src.ptr_r, src.block_size);
+
+		if (param.hash_use && src_zero)
+			sparse_zero_hash((void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), src.block_size);
+		else if (param.hash_use)
+			memcpy((void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), hash_pool_get(&src), param.algo.size);
+
+		if (flag.digest_tree == 1)
+			digest_tree_add((const void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)));
 
 		if (IS_MODE(digest.open_mode, READ))
 		{
-			if (memcmp(digest.ptr_r, (const void *)(oper.hash_buf + (digest.rel_off - digest.mov_off)), param.algo.size) == 0)
+			if (!compare_dirty(&src))
 			{
 				prog.c_dig_wri = false;
 				prog.c_dig_mat = true;
 			}
 		}
 
+		/* the unchanged blocks that follow in the compared window are passed as one run */
+		size_t clean_blocks = 0;
+
+		if (prog.c_dig_mat)
+			clean_blocks = pass_clean_run();
+
 		if (prog.c_dig_wri)
 		{
 			oper.digest_wri_buf_size += digest.block_size;
@@ -726,23 +1218,26 @@ void make_digest(void)
 			prog.wri_bytes += digest.block_size;
 		}
 		else
-			digest_flush = digest.block_size;
+			digest_flush = (clean_blocks + 1) * digest.block_size;
 
 		if (flag.progress > 1)
 			print_detail_progress();
-		else if (flag.progress == 1)
+		else if (progress_due)
 			print_progress();
 
-		digest.abs_off += digest.block_size;
-		digest.rel_off += digest.block_size;
+		digest.abs_off += (clean_blocks + 1) * digest.block_size;
+		digest.rel_off += (clean_blocks + 1) * digest.block_size;
 
-		src.abs_off += src.block_size;
-		src.rel_off += src.block_size;
+		src.abs_off += (clean_blocks + 1) * src.block_size;
+		src.rel_off += (clean_blocks + 1) * src.block_size;
 
 		oper.num_block++;
 	}
 
-	digest_wri_flush(0);
+	digest_wri_flush(digest_flush);
+
+	if (flag.digest_tree == 1)
+		digest_tree_write();
 }
 
 void init_params(void)
@@ -753,13 +1248,14 @@ void init_params(void)
 	if (flag.silent)
 		freopen("/dev/null", "w", flag.prst) != NULL;
 
+	check_jobs();
 	init_map_methods();
 
 	if (flag.oper_mode == BLOCKSYNC)
 	{
 		fprintf(flag.prst, "Operation mode: block-sync\n");
 
-		if (src.path == NULL || dst.path == NULL)
+		if (src.path == NULL || (dst.path == NULL && param.remote == NULL))
 		{
 			if (src.path == NULL)
 				fprintf(stderr, "%s - you need to specify the source path (-s, --src=PATH)\n", process_name);
@@ -775,18 +1271,28 @@ void init_params(void)
 			check_algo_param();
 
 		check_block_size();
+		check_threads();
 		init_src_device();
-		init_dst_device();
 
-		if (digest.path != NULL)
-			init_digest_file();
+		if (param.remote != NULL)
+			init_remote_target();
 		else
+			init_dst_device();
+
+		digest_cache_init();
+
+		if (param.remote == NULL && digest.path != NULL)
+			init_digest_file();
+		else if (param.remote == NULL)
 			fprintf(flag.prst, "%s: Warning: works without digest file.\n", process_name);
 
 		if (IS_MODE(digest.open_mode, READ))
 			dst.open_mode ^= READ;
 
-		if (!IS_MODE(digest.open_mode, READ) && IS_MODE(dst.open_mode, READ))
+		if (param.remote != NULL)
+			fprintf(flag.prst, "Works without digest file, hashes of the target blocks are computed by the remote\n");
+
+		else if (!IS_MODE(digest.open_mode, READ) && IS_MODE(dst.open_mode, READ))
 			fprintf(flag.prst, "Works without reads from digest file, data to compare will be read from the destination device\n");
 
 		else if (!IS_MODE(digest.open_mode, WRITE))
@@ -821,6 +1327,7 @@ void init_params(void)
 		if (param.hash_algo != NULL)
 			check_algo_param();
 
+		check_threads();
 		init_src_device();
 		if (digest.path != NULL)
 			init_digest_file();
@@ -858,9 +1365,10 @@ void init_params(void)
 			check_algo_param();
 
 		check_block_size();
+		check_threads();
 		init_src_device();
 		init_digest_file();
-		param.data_size = digest.data_size - HEADER_SIZE;
+		param.data_size = param.num_blocks * param.algo.size;
 	}
 
 	fprintf(flag.prst, "Buffer size: %s per device\n", format_units(param.max_buf_size, true));
@@ -887,11 +1395,20 @@ void init_params(void)
 		dst.buf_size = (dst.data_size < dst.max_buf_size ? dst.data_size : dst.max_buf_size);
 	}
 
+	if (flag.direct_io == 1)
+	{
+		if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == MAKEDELTA || flag.oper_mode == MAKEDIGEST)
+			init_direct_io(&src);
+
+		if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == APPLYDELTA)
+			init_direct_io(&dst);
+	}
+
 	bool buf_adj_delta = false;
 
 	if (flag.oper_mode == MAKEDELTA)
 	{
-		delta.block_size = sizeof(u_int64_t) + param.block_size;
+		delta.block_size = 2 * sizeof(uint64_t) + param.block_size;
 		delta.max_buf_size = (src.max_buf_size / param.block_size) * delta.block_size;
 		// buf_adj_delta = adjust_buffer(&delta.max_buf_size, delta.block_size);
 
@@ -899,26 +1416,32 @@ void init_params(void)
 			delta.buf_data = realloc(delta.buf_data, delta.max_buf_size);
 
 		oper.delta_buf = malloc(delta.max_buf_size);
+
+		if (delta.codec != CODEC_NONE)
+			compress_init(&delta, delta.max_buf_size);
+
 		map_buffer(&delta);
 	}
 
 	if (flag.oper_mode == APPLYDELTA)
 	{
-		delta.block_size = sizeof(u_int64_t) + param.block_size;
+		delta.block_size = (delta_header.format == DELTA_EXTENTS ? 2 : 1) * sizeof(uint64_t) + param.block_size;
 		delta.max_buf_size = (dst.max_buf_size / param.block_size) * delta.block_size;
 		// buf_adj_delta = adjust_buffer(&delta.max_buf_size, delta.block_size);
 
 		if (IS_MODE(delta.open_mode, DIRECT_R) || IS_MODE(delta.open_mode, PIPE_R))
 			delta.buf_data = realloc(delta.buf_data, delta.max_buf_size);
 
-		oper.delta_buf = malloc(dst.max_buf_size);
-		map_buffer(&delta);
+		oper.delta_buf = alloc_buffer(dst.max_buf_size);
+
+		if (!zero_copy_init())
+			map_buffer(&delta);
 	}
 
 	if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == MAKEDELTA || flag.oper_mode == MAKEDIGEST)
 	{
 		if (IS_MODE(src.open_mode, DIRECT) || IS_MODE(src.open_mode, PIPE))
-			src.buf_data = malloc(src.buf_size);
+			src.buf_data = alloc_buffer(dio_size(&src, src.buf_size));
 
 		if (IS_MODE(digest.open_mode, WRITE))
 		{
@@ -940,11 +1463,43 @@ void init_params(void)
 	if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == APPLYDELTA)
 	{
 		if (IS_MODE(dst.open_mode, DIRECT))
-			dst.buf_data = malloc(dst.buf_size);
+			dst.buf_data = alloc_buffer(dio_size(&dst, dst.buf_size));
+	}
+
+	if (flag.sparse == 1)
+		sparse_init();
+
+	copy_range_init();
+	sectors_init();
+	changed_ranges_init();
+
+	if ((flag.oper_mode == BLOCKSYNC && IS_MODE(dst.open_mode, READ)) || (param.hash_use && IS_MODE(digest.open_mode, READ)))
+		compare_init(src.max_buf_size, param.block_size);
+
+	coarse_init();
+	checkpoint_init();
+	changed_ranges_start();
+	jobs_fork();
+
+	if (param.read_ahead > 0 && flag.oper_mode != APPLYDELTA)
+	{
+		fprintf(flag.prst, "Read-ahead: %d buffers per device\n", param.read_ahead);
+
+		if ((IS_MODE(src.open_mode, DIRECT_R) && !IS_MODE(src.open_mode, URING)) || IS_MODE(src.open_mode, PIPE_R))
+			readahead_init(&src, param.read_ahead);
+
+		if (flag.oper_mode == BLOCKSYNC && IS_MODE(dst.open_mode, DIRECT_R) && !IS_MODE(dst.open_mode, URING))
+			readahead_init(&dst, param.read_ahead);
+
+		if (flag.oper_mode == BLOCKSYNC && IS_MODE(dst.open_mode, DIRECT_W) && !IS_MODE(dst.open_mode, URING))
+			readahead_writer_init();
 	}
 
 	fprintf(flag.prst, "Block size: %s per block out of %zu blocks\n", format_units(param.block_size, true), param.num_blocks);
 
+	if (!param.hash_use || !IS_MODE(digest.open_mode, WRITE))
+		flag.digest_tree = 0;
+
 	if (param.hash_use)
 	{
 		hash_init(param.algo.value, param.algo.library);
@@ -953,6 +1508,18 @@ void init_params(void)
 		fprintf(flag.prst, "Hash algo: '%s' uses %d bytes per block\n",
 				param.algo.symbol, param.algo.size);
 
+		hash_pool_init(param.threads, src.max_buf_size, param.block_size);
+
+		if (param.threads > 1)
+			fprintf(flag.prst, "Hash threads: %d per buffer\n", param.threads);
+
+		if (flag.digest_tree == 1)
+		{
+			digest_tree_init();
+			/* a resumed run starts the tree with the hashes stored below its first block */
+			digest_tree_rebuild(oper.num_block);
+		}
+
 		if (param.algo.size > param.block_size)
 			fprintf(flag.prst, "Warning: block size '%ld' is smaller than hash '%s' size\n", param.block_size, param.algo.symbol);
 	}
@@ -967,6 +1534,16 @@ void init_params(void)
 	}
 
 	snprintf(param.pro_form, sizeof(param.pro_form), "\rProgress: %%.%df%s", param.pro_prec, "%%");
+	progress_init();
+}
+
+static void sync_volume(void)
+{
+	init_params();
+	blocksync();
+	changed_ranges_finish();
+	coarse_write();
+	digest_cache_finish();
 }
 
 int main(int argc, char **argv)
@@ -975,7 +1552,10 @@ int main(int argc, char **argv)
 	flag.prst = stdout;
 
 	process_name = basename(argv[0]);
+	progress_signal_init(SA_RESTART);
 	parse_options(argc, argv);
+	throttle_init(param.max_rate, param.max_iops);
+	stats_init();
 
 	switch (flag.oper_mode)
 	{
@@ -994,15 +1574,49 @@ int main(int argc, char **argv)
 		delta_info();
 		break;
 
+	case COMPAREDIGESTS:
+		/* the extents are printed to stdout */
+		flag.prst = stderr;
+
+		if (flag.silent && freopen("/dev/null", "w", flag.prst) == NULL)
+			cleanup(EXIT_FAILURE);
+
+		compare_digests();
+		break;
+
 	case BLOCKSYNC:
+		if (flag.server == 1)
+		{
+			remote_server();
+			print_summary();
+			break;
+		}
+
+		if (param.jobs_file != NULL)
+			batch_run(sync_volume);
+
 		init_params();
+
+		if (param.remote != NULL)
+		{
+			remote_sync();
+			print_summary();
+			break;
+		}
+
 		blocksync();
+		jobs_finish();
+		changed_ranges_finish();
+		coarse_write();
+		digest_cache_finish();
 		print_summary();
 		break;
 
 	case MAKEDELTA:
 		init_params();
 		make_delta();
+		changed_ranges_finish();
+		coarse_write();
 		print_summary();
 		break;
 
@@ -1015,6 +1629,9 @@ int main(int argc, char **argv)
 	case MAKEDIGEST:
 		init_params();
 		make_digest();
+		jobs_finish();
+		changed_ranges_finish();
+		coarse_write();
 		print_summary();
 		break;
 	}
@@ -0,0 +1,339 @@
+/*
+ ./src/changed_ranges.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "changed_ranges.h"
+#include "digest_tree.h"
+
+/*
+ With --changed-ranges=FILE block-sync, make-delta and make-digest process
+ only the listed ranges of the device, as reported by a changed block
+ tracker. The file is either text, one 'OFFSET LENGTH' pair per line in
+ decimal or 0x hex, or binary, pairs of native uint64_t like the extent
+ headers of a delta. A file with a NUL byte is taken as binary.
+
+ The ranges are widened to whole blocks, sorted and merged. The main loops
+ run over one range at a time: the data size of the devices is clamped to
+ its end, so no buffer is loaded beyond it, and the offsets of the devices
+ and the digest are moved to the start of the next one. The digest slots of
+ the blocks outside the ranges are left as they are, so the digest has to
+ exist already; the digest tree is rebuilt from the whole digest at the end.
+*/
+
+struct changed_range
+{
+	uint64_t off;
+	uint64_t len;
+};
+
+static struct changed_ranges
+{
+	bool active;
+	bool digest_tree;
+	size_t count;
+	size_t next;
+	size_t src_size;
+	size_t dst_size;
+	struct changed_range *list;
+} ranges = {false, false, 0, 0, 0, 0, NULL};
+
+static void changed_ranges_add(uint64_t off, uint64_t len)
+{
+	if (len == 0 || off >= src.data_size)
+		return;
+
+	uint64_t end = (len > src.data_size - off ? src.data_size : off + len);
+
+	off -= off % param.block_size;
+	end = MIN(((end + param.block_size - 1) / param.block_size) * param.block_size, (uint64_t)src.data_size);
+
+	struct changed_range *list = realloc(ranges.list, (ranges.count + 1) * sizeof(struct changed_range));
+
+	if (list == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for changed ranges\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	ranges.list = list;
+	ranges.list[ranges.count].off = off;
+	ranges.list[ranges.count].len = end - off;
+	ranges.count++;
+}
+
+static void changed_ranges_invalid(size_t line)
+{
+	fprintf(stderr, "%s: changed ranges file '%s' is invalid at line %zu\n", process_name, param.changed_ranges, line);
+	cleanup(EXIT_FAILURE);
+}
+
+static void changed_ranges_parse_text(char *data)
+{
+	size_t line = 0;
+
+	for (char *next = data; next != NULL; )
+	{
+		char *str = next;
+		char *end = strchr(str, '\n');
+
+		next = (end != NULL ? end + 1 : NULL);
+
+		if (end != NULL)
+			*end = '\0';
+
+		line++;
+		str += strspn(str, " \t\r");
+
+		if (*str == '\0' || *str == '#')
+			continue;
+
+		errno = 0;
+		uint64_t off = strtoull(str, &end, 0);
+
+		if (errno != 0 || end == str || strchr(" \t,", *end) == NULL || *end == '\0')
+			changed_ranges_invalid(line);
+
+		str = end + strspn(end, " \t,");
+		uint64_t len = strtoull(str, &end, 0);
+
+		if (errno != 0 || end == str || end[strspn(end, " \t\r")] != '\0')
+			changed_ranges_invalid(line);
+
+		changed_ranges_add(off, len);
+	}
+}
+
+static void changed_ranges_parse_binary(const char *data, size_t size)
+{
+	uint64_t extent[2];
+
+	if (size % sizeof(extent) != 0)
+	{
+		fprintf(stderr, "%s: changed ranges file '%s' is invalid\n", process_name, param.changed_ranges);
+		cleanup(EXIT_FAILURE);
+	}
+
+	for (size_t pos = 0; pos < size; pos += sizeof(extent))
+	{
+		memcpy(extent, data + pos, sizeof(extent));
+		changed_ranges_add(extent[0], extent[1]);
+	}
+}
+
+static void changed_ranges_read(void)
+{
+	struct stat st;
+	char *data = NULL;
+	int fd = open(param.changed_ranges, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0 || (data = malloc(st.st_size + 1)) == NULL ||
+		read(fd, data, st.st_size) != st.st_size)
+	{
+		fprintf(stderr, "%s: unable to read changed ranges file '%s': %s\n", process_name, param.changed_ranges, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	close(fd);
+	data[st.st_size] = '\0';
+
+	if (memchr(data, '\0', st.st_size) != NULL)
+		changed_ranges_parse_binary(data, st.st_size);
+	else
+		changed_ranges_parse_text(data);
+
+	free(data);
+}
+
+static int changed_ranges_cmp(const void *a, const void *b)
+{
+	const struct changed_range *ra = a, *rb = b;
+
+	return (ra->off > rb->off) - (ra->off < rb->off);
+}
+
+static void changed_ranges_merge(void)
+{
+	size_t count = 0;
+
+	qsort(ranges.list, ranges.count, sizeof(struct changed_range), changed_ranges_cmp);
+
+	for (size_t i = 0; i < ranges.count; i++)
+	{
+		struct changed_range *range = &ranges.list[i];
+		struct changed_range *last = (count > 0 ? &ranges.list[count - 1] : NULL);
+
+		if (last != NULL && range->off <= last->off + last->len)
+			last->len = MAX(last->len, range->off + range->len - last->off);
+		else
+			ranges.list[count++] = *range;
+	}
+
+	ranges.count = count;
+}
+
+void changed_ranges_init(void)
+{
+	if (param.changed_ranges == NULL)
+		return;
+
+	if (flag.oper_mode != BLOCKSYNC && flag.oper_mode != MAKEDELTA && flag.oper_mode != MAKEDIGEST)
+	{
+		fprintf(flag.prst, "Warning: --changed-ranges is supported by block-sync, make-delta and make-digest only\n");
+		return;
+	}
+
+	if (param.remote != NULL)
+	{
+		fprintf(flag.prst, "Warning: --changed-ranges is not supported with --remote, all blocks will be synced\n");
+		return;
+	}
+
+	if (IS_MODE(src.open_mode, PIPE) || IS_MODE(digest.open_mode, PIPE))
+	{
+		fprintf(stderr, "%s: --changed-ranges needs a seekable source and digest file\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	/* the hashes of the blocks outside the ranges are kept from the digest */
+	if (IS_MODE(digest.open_mode, WRITE) && !IS_MODE(digest.open_mode, READ))
+	{
+		fprintf(stderr, "%s: --changed-ranges needs an existing digest file of the device\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	changed_ranges_read();
+	changed_ranges_merge();
+
+	if (param.jobs > 1)
+	{
+		fprintf(flag.prst, "Warning: --jobs does not split changed ranges, works with one job\n");
+		param.jobs = 1;
+	}
+
+	if (param.read_ahead > 0)
+	{
+		fprintf(flag.prst, "Warning: --read-ahead loads buffers in sequence, works without it with changed ranges\n");
+		param.read_ahead = 0;
+	}
+
+	size_t size = 0;
+
+	for (size_t i = 0; i < ranges.count; i++)
+		size += ranges.list[i].len;
+
+	ranges.active = true;
+	ranges.src_size = src.data_size;
+	ranges.dst_size = dst.data_size;
+
+	fprintf(flag.prst, "Changed ranges: %zu ranges of ", ranges.count);
+	fprintf(flag.prst, "%s from '%s'\n", format_units(size, true), param.changed_ranges);
+}
+
+/* called once a checkpoint has set the start of the run */
+void changed_ranges_start(void)
+{
+	if (!ranges.active)
+		return;
+
+	while (ranges.next < ranges.count && ranges.list[ranges.next].off + ranges.list[ranges.next].len <= (uint64_t)src.abs_off)
+		ranges.next++;
+
+	/* a resumed run continues inside its range */
+	if (ranges.next < ranges.count && ranges.list[ranges.next].off < (uint64_t)src.abs_off)
+	{
+		ranges.list[ranges.next].len -= src.abs_off - ranges.list[ranges.next].off;
+		ranges.list[ranges.next].off = src.abs_off;
+	}
+
+	ranges.digest_tree = flag.digest_tree == 1 && param.hash_use && IS_MODE(digest.open_mode, WRITE);
+	flag.digest_tree = 0;
+
+	if (changed_ranges_left())
+		changed_ranges_next();
+	else
+	{
+		src.abs_off = src.data_size;
+		dst.abs_off = dst.data_size;
+	}
+}
+
+bool changed_ranges_left(void)
+{
+	return ranges.active && ranges.next < ranges.count;
+}
+
+/* the caller has flushed all pending writes of the previous range */
+void changed_ranges_next(void)
+{
+	struct changed_range *range = &ranges.list[ranges.next++];
+	size_t first = range->off / param.block_size;
+
+	src.abs_off = range->off;
+	src.data_size = range->off + range->len;
+	src.buf_off = 0;
+
+	if (flag.oper_mode == BLOCKSYNC)
+	{
+		dst.abs_off = src.abs_off;
+		dst.data_size = MIN(src.data_size, ranges.dst_size);
+		dst.buf_off = 0;
+	}
+
+	digest.abs_off = HEADER_SIZE + first * digest.block_size;
+	digest.buf_off = 0;
+
+	oper.num_block = first;
+}
+
+/* returns true when a part of the given range of the device may have changed */
+bool changed_ranges_overlap(off_t off, size_t size)
+{
+	if (!ranges.active)
+		return true;
+
+	for (size_t i = 0; i < ranges.count && ranges.list[i].off < (uint64_t)off + size; i++)
+		if (ranges.list[i].off + ranges.list[i].len > (uint64_t)off)
+			return true;
+
+	return false;
+}
+
+void changed_ranges_finish(void)
+{
+	if (!ranges.active)
+		return;
+
+	src.data_size = ranges.src_size;
+	dst.data_size = ranges.dst_size;
+
+	if (ranges.digest_tree)
+	{
+		flag.digest_tree = 1;
+		digest_tree_init();
+		digest_tree_rebuild(param.num_blocks);
+		digest_tree_write();
+	}
+
+	oper.num_block = param.num_blocks - 1;
+}
+
+void changed_ranges_free(void)
+{
+	free(ranges.list);
+	memset(&ranges, 0, sizeof(ranges));
+}
@@ -0,0 +1,185 @@
+/*
+ ./src/checkpoint.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "checkpoint.h"
+#include "uring.h"
+#include "readahead.h"
+
+#include <stddef.h>
+
+/*
+ A long block-sync or make-delta stores a checkpoint in the digest header
+ every CHECKPOINT_INTERVAL seconds, at a buffer reload. All pending writes are
+ flushed and synced first, so everything below resume_off is on the disk: the
+ target (or the delta file up to resume_delta) and the block hashes. A run
+ which finishes clears the checkpoint.
+
+ With --resume the next run starts right at resume_off, reading neither the
+ source nor the target below it. resume_delta is 0 for block-sync, so the
+ checkpoint of one mode is never resumed by the other.
+*/
+
+static struct checkpoint
+{
+	bool enabled;
+	uint64_t resume_off;
+	uint64_t resume_delta;
+	time_t last;
+} cp = {false, 0, 0, 0};
+
+static void checkpoint_write(uint64_t resume_off, uint64_t resume_delta)
+{
+	uint64_t fields[2] = {resume_off, resume_delta};
+
+	if (pwrite(digest.fd, (const void *)fields, sizeof(fields), offsetof(struct bsf_header, resume_off)) < 0)
+	{
+		fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, digest.path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+static void checkpoint_sync(struct dev *dev)
+{
+	if (dev->fd >= 0 && IS_MODE(dev->open_mode, WRITE) && !IS_MODE(dev->open_mode, PIPE) && fdatasync(dev->fd) < 0)
+	{
+		fprintf(stderr, "%s: error while syncing '%s' : %s\n", process_name, dev->path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+/* called while the header of a digest which is read is still in digest_header */
+void checkpoint_load(void)
+{
+	if (flag.resume == 0)
+		return;
+
+	if (digest_header.resume_off == 0)
+	{
+		fprintf(flag.prst, "Resume: digest file has no checkpoint, starts from the beginning\n");
+		return;
+	}
+
+	bool delta_mode = flag.oper_mode == MAKEDELTA;
+
+	if (digest_header.data_size != src.data_size || digest_header.block_size != param.block_size ||
+		digest_header.resume_off % param.block_size != 0 || digest_header.resume_off >= src.data_size ||
+		delta_mode != (digest_header.resume_delta > 0))
+	{
+		fprintf(flag.prst, "Warning: checkpoint of the digest file does not match this run, starts from the beginning\n");
+		return;
+	}
+
+	cp.resume_off = digest_header.resume_off;
+	cp.resume_delta = digest_header.resume_delta;
+}
+
+/* a resumed checkpoint stays in the rewritten header until the run stores a newer one */
+void checkpoint_header(struct bsf_header *header)
+{
+	header->resume_off = cp.resume_off;
+	header->resume_delta = cp.resume_delta;
+}
+
+/* returns the size of the delta file make-delta continues, 0 when the delta is written from the start */
+size_t checkpoint_delta_size(void)
+{
+	struct stat st;
+
+	if (cp.resume_off == 0)
+		return 0;
+
+	if (delta.path == NULL || param.codec != CODEC_NONE || stat(delta.path, &st) < 0 || !S_ISREG(st.st_mode) ||
+		cp.resume_delta < HEADER_SIZE || (uint64_t)st.st_size < cp.resume_delta)
+	{
+		fprintf(flag.prst, "Warning: delta file can not be continued, starts from the beginning\n");
+		checkpoint_write(0, 0);
+		cp.resume_off = cp.resume_delta = 0;
+		return 0;
+	}
+
+	return cp.resume_delta;
+}
+
+void checkpoint_init(void)
+{
+	cp.enabled = (flag.oper_mode == BLOCKSYNC || flag.oper_mode == MAKEDELTA) && digest.path != NULL &&
+				 IS_MODE(digest.open_mode, WRITE) && !IS_MODE(digest.open_mode, PIPE) && !BIT_SET(flag.dont_write, 0) && param.jobs < 2;
+
+	if (flag.oper_mode == BLOCKSYNC && BIT_SET(flag.dont_write, 1))
+		cp.enabled = false;
+
+	if (flag.oper_mode == MAKEDELTA && (delta.path == NULL || delta.codec != CODEC_NONE))
+		cp.enabled = false;
+
+	cp.last = time(NULL);
+
+	if (cp.resume_off == 0)
+		return;
+
+	if (!cp.enabled)
+	{
+		fprintf(flag.prst, "Warning: --resume is not supported with these options, starts from the beginning\n");
+		return;
+	}
+
+	size_t first = cp.resume_off / param.block_size;
+
+	src.abs_off = cp.resume_off;
+	dst.abs_off = cp.resume_off;
+
+	/* the digest was mapped at the first hash, so its buffer is reloaded at the checkpoint */
+	digest.abs_off = HEADER_SIZE + first * digest.block_size;
+	digest.buf_off = 0;
+
+	if (flag.oper_mode == MAKEDELTA)
+	{
+		delta.abs_off = cp.resume_delta;
+		delta.buf_off = 0;
+	}
+
+	oper.num_block = first;
+
+	fprintf(flag.prst, "Resume: continues from %s, block %zu\n", format_units(cp.resume_off, true), first);
+}
+
+bool checkpoint_due(void)
+{
+	return cp.enabled && time(NULL) - cp.last >= CHECKPOINT_INTERVAL;
+}
+
+/* the caller has flushed all pending writes up to src.abs_off */
+void checkpoint_save(void)
+{
+	uring_wait();
+	readahead_drain();
+
+	checkpoint_sync(&dst);
+	checkpoint_sync(&delta);
+	checkpoint_sync(&digest);
+
+	checkpoint_write(src.abs_off, flag.oper_mode == MAKEDELTA ? (uint64_t)delta.abs_off : 0);
+
+	cp.last = time(NULL);
+}
+
+void checkpoint_clear(void)
+{
+	if (cp.enabled)
+		checkpoint_write(0, 0);
+}
@@ -0,0 +1,323 @@
+/*
+ ./src/coarse.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "coarse.h"
+#include "digest_tree.h"
+#include "changed_ranges.h"
+
+#include <stddef.h>
+
+/*
+ A coarse digest appends one hash of the data of every COARSE_SIZE range of
+ the device, followed by one byte per range which is set when its hash is
+ valid:
+
+ | header | block hashes | tree levels | coarse hashes | coarse valid flags |
+
+ Before the blocks of a loaded buffer are hashed, every range which lies
+ whole in the buffer is hashed at once. When it matches the stored coarse
+ hash, its blocks take their stored hashes instead of being hashed one by
+ one, so the comparison finds them unchanged. Only the blocks of changed
+ ranges are hashed, compared and written.
+
+ A range which continues in the next buffer is copied aside and hashed when
+ the next buffer completes it, and the jobs split the device at range
+ boundaries, so every range processed in order gets a valid hash. Ranges cut
+ by --changed-ranges or a --resume offset stay invalid until a later run.
+
+ The coarse hashes are written and DIGEST_COARSE is set in the header once the
+ run has finished, so a digest of an interrupted run is never trusted by its
+ coarse hashes.
+*/
+
+static struct coarse
+{
+	bool active;
+	bool stored;
+	bool stored_tree;
+	bool tree;
+	int hash_size;
+	size_t data_size;
+	size_t count;
+	off_t offset;
+	char *hashes;
+	char *valid;
+	char *old_hashes;
+	char *old_valid;
+	size_t max_hashes;
+	size_t num_hashes;
+	bool *clean;
+	char *fine;
+	char *carry;
+	size_t carry_range;
+	size_t carry_len;
+	size_t hashed_bytes;
+	size_t clean_bytes;
+} coarse = {false, false, false, false, 0, 0, 0, 0, NULL, NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, 0, 0, 0, 0};
+
+size_t coarse_size(size_t data_size, int hash_size)
+{
+	return ((data_size + COARSE_SIZE - 1) / COARSE_SIZE) * (hash_size + 1);
+}
+
+/* called while the header of a digest which is read is still in digest_header */
+void coarse_load(void)
+{
+	coarse.stored = (digest_header.hash_type & DIGEST_COARSE) && digest_header.data_size == src.data_size;
+	coarse.stored_tree = (digest_header.hash_type & DIGEST_TREE) != 0;
+}
+
+static void coarse_read_stored(void)
+{
+	size_t size = coarse_size(coarse.data_size, coarse.hash_size);
+
+	coarse.old_hashes = malloc(size);
+
+	if (coarse.old_hashes == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for coarse hashes\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (pread(digest.fd, coarse.old_hashes, size, coarse.offset) != (ssize_t)size)
+	{
+		fprintf(flag.prst, "Warning: coarse hashes of the digest file are incomplete, all blocks will be hashed\n");
+		free(coarse.old_hashes);
+		coarse.old_hashes = NULL;
+		return;
+	}
+
+	coarse.old_valid = coarse.old_hashes + coarse.count * coarse.hash_size;
+
+	/* the ranges which --changed-ranges leaves out are not loaded, so they keep their stored hashes */
+	for (size_t c = 0; c < coarse.count; c++)
+		if (coarse.old_valid[c] && !changed_ranges_overlap(c * COARSE_SIZE, COARSE_SIZE))
+		{
+			memcpy(coarse.hashes + c * coarse.hash_size, coarse.old_hashes + c * coarse.hash_size, coarse.hash_size);
+			coarse.valid[c] = 1;
+		}
+}
+
+void coarse_init(void)
+{
+	if (flag.digest_coarse == 0 || !IS_MODE(digest.open_mode, WRITE))
+		return;
+
+	coarse.hash_size = param.algo.size;
+	coarse.data_size = src.data_size;
+	coarse.count = (coarse.data_size + COARSE_SIZE - 1) / COARSE_SIZE;
+	coarse.tree = flag.digest_tree == 1;
+	coarse.offset = HEADER_SIZE + param.num_blocks * coarse.hash_size;
+
+	if (coarse.tree)
+		coarse.offset += digest_tree_size(param.num_blocks, param.block_size, coarse.hash_size);
+
+	/* the jobs fill their ranges of one shared array */
+	coarse.hashes = mmap(NULL, coarse_size(coarse.data_size, coarse.hash_size), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	coarse.max_hashes = (src.max_buf_size / param.block_size) + 2;
+	coarse.clean = calloc(coarse.max_hashes, sizeof(bool));
+	coarse.fine = malloc(coarse.max_hashes * coarse.hash_size);
+	coarse.carry = malloc(COARSE_SIZE);
+
+	if (coarse.hashes == MAP_FAILED || coarse.clean == NULL || coarse.fine == NULL || coarse.carry == NULL)
+	{
+		coarse.hashes = NULL;
+		fprintf(stderr, "%s: unable to allocate memory for coarse hashes\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	coarse.valid = coarse.hashes + coarse.count * coarse.hash_size;
+	coarse.active = true;
+
+	if (coarse.stored && coarse.stored_tree == coarse.tree && IS_MODE(digest.open_mode, READ))
+		coarse_read_stored();
+
+	fprintf(flag.prst, "Coarse hashes: %zu ranges of %s%s\n", coarse.count, format_units(COARSE_SIZE, false),
+			coarse.old_hashes != NULL ? ", blocks of unchanged ranges are not hashed" : "");
+}
+
+/* hashes range c from data and marks its blocks from off on, which lie in the buffer at start, when it is unchanged */
+static bool coarse_range(size_t c, const char *data, size_t off, size_t start)
+{
+	size_t end = MIN((c + 1) * COARSE_SIZE, coarse.data_size);
+	char *hash = coarse.hashes + c * coarse.hash_size;
+
+	hash_buffer(param.algo.value, param.algo.library, coarse.hash_size, (void *)hash, (const void *)data, end - c * COARSE_SIZE);
+
+	coarse.valid[c] = 1;
+	coarse.hashed_bytes += end - c * COARSE_SIZE;
+
+	if (coarse.old_hashes == NULL || coarse.old_valid[c] == 0 ||
+		memcmp(hash, coarse.old_hashes + c * coarse.hash_size, coarse.hash_size) != 0)
+		return false;
+
+	size_t first = (off - start) / param.block_size;
+	size_t last = MIN(coarse.num_hashes, (end - start + param.block_size - 1) / param.block_size);
+
+	memset(coarse.clean + first, true, (last - first) * sizeof(bool));
+	coarse.clean_bytes += end - c * COARSE_SIZE;
+
+	return true;
+}
+
+/* hashes the ranges which end in the loaded buffer and marks the blocks of the unchanged ones */
+void coarse_run(struct dev *dev)
+{
+	if (!coarse.active)
+		return;
+
+	size_t start = dev->abs_off;
+	size_t len = dev->buf_size - dev->mov_off;
+	const char *data = dev->buf_data + dev->mov_off;
+	bool any_clean = false;
+
+	coarse.num_hashes = MIN(coarse.max_hashes, (len + param.block_size - 1) / param.block_size);
+	memset(coarse.clean, 0, coarse.num_hashes * sizeof(bool));
+
+	/* a range carried over from the previous buffer is completed when this one continues it */
+	if (coarse.carry_len > 0)
+	{
+		size_t off = coarse.carry_range * COARSE_SIZE + coarse.carry_len;
+		size_t end = MIN(off - coarse.carry_len + COARSE_SIZE, coarse.data_size);
+
+		if (off < start || off >= start + len)
+			coarse.carry_len = 0;
+		else
+		{
+			size_t size = MIN(end, start + len) - off;
+
+			memcpy(coarse.carry + coarse.carry_len, data + (off - start), size);
+			coarse.carry_len += size;
+
+			if (off + size == end)
+			{
+				any_clean |= coarse_range(coarse.carry_range, coarse.carry, MAX(start, end - coarse.carry_len), start);
+				coarse.carry_len = 0;
+			}
+		}
+	}
+
+	for (size_t c = (start + COARSE_SIZE - 1) / COARSE_SIZE; c * COARSE_SIZE < start + len; c++)
+	{
+		size_t off = c * COARSE_SIZE;
+		size_t size = MIN(COARSE_SIZE, coarse.data_size - off);
+
+		/* a range which continues in the next buffer is carried over */
+		if (off + size > start + len)
+		{
+			coarse.carry_range = c;
+			coarse.carry_len = start + len - off;
+			memcpy(coarse.carry, data + (off - start), coarse.carry_len);
+			break;
+		}
+
+		any_clean |= coarse_range(c, data + (off - start), off, start);
+	}
+
+	if (!any_clean)
+		return;
+
+	size_t size = coarse.num_hashes * coarse.hash_size;
+
+	if (pread(digest.fd, coarse.fine, size, HEADER_SIZE + (start / param.block_size) * coarse.hash_size) != (ssize_t)size)
+	{
+		fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name, digest.path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+/* copies the stored hashes of the unchanged blocks from first on and returns their number */
+size_t coarse_clean_run(size_t first, size_t last, char *hashes)
+{
+	size_t i = first;
+
+	if (!coarse.active)
+		return 0;
+
+	while (i < last && i < coarse.num_hashes && coarse.clean[i])
+		i++;
+
+	memcpy(hashes + first * coarse.hash_size, coarse.fine + first * coarse.hash_size, (i - first) * coarse.hash_size);
+
+	return i - first;
+}
+
+/* returns the number of blocks from first on which have to be hashed */
+size_t coarse_dirty_run(size_t first, size_t last)
+{
+	size_t i = first;
+
+	if (!coarse.active)
+		return last - first;
+
+	while (i < last && (i >= coarse.num_hashes || !coarse.clean[i]))
+		i++;
+
+	return i - first;
+}
+
+void coarse_write(void)
+{
+	if (!coarse.active || BIT_SET(flag.dont_write, 0))
+		return;
+
+	size_t size = coarse_size(coarse.data_size, coarse.hash_size);
+	uint64_t hash_type = param.algo.value | (coarse.tree ? DIGEST_TREE : 0) | DIGEST_COARSE;
+
+	if (pwrite(digest.fd, coarse.hashes, size, coarse.offset) != (ssize_t)size ||
+		pwrite(digest.fd, (const void *)&hash_type, sizeof(hash_type), offsetof(struct bsf_header, hash_type)) < 0)
+	{
+		fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, digest.path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+void coarse_save_stats(struct job_stats *js)
+{
+	js->coarse_hashed_bytes = coarse.hashed_bytes;
+	js->coarse_clean_bytes = coarse.clean_bytes;
+}
+
+void coarse_merge_stats(const struct job_stats *js)
+{
+	coarse.hashed_bytes += js->coarse_hashed_bytes;
+	coarse.clean_bytes += js->coarse_clean_bytes;
+}
+
+void coarse_print_stats(void)
+{
+	if (!coarse.active || coarse.old_hashes == NULL)
+		return;
+
+	fprintf(flag.prst, "Coarse: %s in unchanged ranges ", format_units(coarse.clean_bytes, false));
+	fprintf(flag.prst, "out of %s, their blocks were not hashed\n", format_units(coarse.hashed_bytes, false));
+}
+
+void coarse_free(void)
+{
+	if (coarse.hashes != NULL)
+		munmap(coarse.hashes, coarse_size(coarse.data_size, coarse.hash_size));
+
+	free(coarse.old_hashes);
+	free(coarse.clean);
+	free(coarse.fine);
+	free(coarse.carry);
+
+	memset(&coarse, 0, sizeof(coarse));
+}
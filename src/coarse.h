@@ -0,0 +1,34 @@
+/*
+ ./src/coarse.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef COARSE_H
+#define COARSE_H
+
+size_t coarse_size(size_t data_size, int hash_size);
+void coarse_load(void);
+void coarse_init(void);
+void coarse_run(struct dev *dev);
+size_t coarse_clean_run(size_t first, size_t last, char *hashes);
+size_t coarse_dirty_run(size_t first, size_t last);
+void coarse_write(void);
+void coarse_save_stats(struct job_stats *js);
+void coarse_merge_stats(const struct job_stats *js);
+void coarse_print_stats(void);
+void coarse_free(void);
+
+#endif
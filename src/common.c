@@ -47,6 +47,22 @@ void digest_read_header(void)
     get_ptr(&digest);
     memcpy((char *)&digest_header.hash_type, (const void *)digest.ptr_r, sizeof(digest_header.hash_type));
     digest.rel_off += sizeof(digest_header.hash_type);
+
+    get_ptr(&digest);
+    memcpy((char *)&digest_header.codec, (const void *)digest.ptr_r, sizeof(digest_header.codec));
+    digest.rel_off += sizeof(digest_header.codec);
+
+    get_ptr(&digest);
+    memcpy((char *)&digest_header.format, (const void *)digest.ptr_r, sizeof(digest_header.format));
+    digest.rel_off += sizeof(digest_header.format);
+
+    get_ptr(&digest);
+    memcpy((char *)&digest_header.resume_off, (const void *)digest.ptr_r, sizeof(digest_header.resume_off));
+    digest.rel_off += sizeof(digest_header.resume_off);
+
+    get_ptr(&digest);
+    memcpy((char *)&digest_header.resume_delta, (const void *)digest.ptr_r, sizeof(digest_header.resume_delta));
+    digest.rel_off += sizeof(digest_header.resume_delta);
 }
 
 void delta_read_header(void)
@@ -78,6 +94,14 @@ void delta_read_header(void)
     get_ptr(&delta);
     memcpy((char *)&delta_header.hash_type, (const void *)delta.ptr_r, sizeof(delta_header.hash_type));
     delta.rel_off += sizeof(delta_header.hash_type);
+
+    get_ptr(&delta);
+    memcpy((char *)&delta_header.codec, (const void *)delta.ptr_r, sizeof(delta_header.codec));
+    delta.rel_off += sizeof(delta_header.codec);
+
+    get_ptr(&delta);
+    memcpy((char *)&delta_header.format, (const void *)delta.ptr_r, sizeof(delta_header.format));
+    delta.rel_off += sizeof(delta_header.format);
 }
 
 bool adjust_buffer(size_t *max_buf_size, size_t block_size)
@@ -0,0 +1,283 @@
+/*
+ ./src/compare.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "compare.h"
+#include "hash_pool.h"
+#include "sparse.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPARE_X86
+#endif
+
+/*
+ Every time the src or digest buffer is loaded, the blocks that can be
+ processed before the next reload are compared at once: with a digest that is
+ read, the hashes of the pool against the stored ones, otherwise the src and
+ dst buffers. The result is a bitmap of changed blocks, indexed by the block
+ number relative to the block the window starts at (cmp.base_off), so the main
+ loops can pass runs of unchanged blocks without visiting them one by one. The
+ kernel that finds the first difference in the data is chosen once by the CPU
+ features. The window is computed again only when the current block leaves it
+ or the src or digest buffer was loaded again.
+*/
+
+static struct compare
+{
+	uint64_t *bitmap;
+	size_t max_blocks;
+	size_t num_blocks;
+	size_t block_size;
+	off_t base_off;
+	off_t end_off;
+	off_t src_buf_off;
+	off_t digest_buf_off;
+	const char *kernel_name;
+	bool (*equal)(const char *a, const char *b, size_t size);
+} cmp = {NULL, 0, 0, 0, 0, 0, -1, -1, "memcmp", NULL};
+
+static bool equal_memcmp(const char *a, const char *b, size_t size)
+{
+	return memcmp(a, b, size) == 0;
+}
+
+#ifdef COMPARE_X86
+__attribute__((target("sse2"))) static bool equal_sse2(const char *a, const char *b, size_t size)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= size; i += 64)
+	{
+		__m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+		__m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)));
+		__m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 32)), _mm_loadu_si128((const __m128i *)(b + i + 32)));
+		__m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 48)), _mm_loadu_si128((const __m128i *)(b + i + 48)));
+		__m128i x = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+			return false;
+	}
+
+	return memcmp(a + i, b + i, size - i) == 0;
+}
+
+__attribute__((target("avx2"))) static bool equal_avx2(const char *a, const char *b, size_t size)
+{
+	size_t i = 0;
+
+	for (; i + 128 <= size; i += 128)
+	{
+		__m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+		__m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 32)), _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+		__m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 64)), _mm256_loadu_si256((const __m256i *)(b + i + 64)));
+		__m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 96)), _mm256_loadu_si256((const __m256i *)(b + i + 96)));
+		__m256i x = _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3));
+
+		if (!_mm256_testz_si256(x, x))
+			return false;
+	}
+
+	return memcmp(a + i, b + i, size - i) == 0;
+}
+
+__attribute__((target("avx512f"))) static bool equal_avx512(const char *a, const char *b, size_t size)
+{
+	size_t i = 0;
+
+	for (; i + 256 <= size; i += 256)
+	{
+		__m512i x0 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i)), _mm512_loadu_si512((const void *)(b + i)));
+		__m512i x1 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i + 64)), _mm512_loadu_si512((const void *)(b + i + 64)));
+		__m512i x2 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i + 128)), _mm512_loadu_si512((const void *)(b + i + 128)));
+		__m512i x3 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i + 192)), _mm512_loadu_si512((const void *)(b + i + 192)));
+		__m512i x = _mm512_or_si512(_mm512_or_si512(x0, x1), _mm512_or_si512(x2, x3));
+
+		if (_mm512_test_epi64_mask(x, x) != 0)
+			return false;
+	}
+
+	return memcmp(a + i, b + i, size - i) == 0;
+}
+#endif
+
+static void compare_kernel(void)
+{
+	cmp.equal = equal_memcmp;
+
+#ifdef COMPARE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		cmp.equal = equal_avx512;
+		cmp.kernel_name = "avx512";
+	}
+	else if (__builtin_cpu_supports("avx2"))
+	{
+		cmp.equal = equal_avx2;
+		cmp.kernel_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		cmp.equal = equal_sse2;
+		cmp.kernel_name = "sse2";
+	}
+#endif
+}
+
+void compare_init(size_t max_buf_size, size_t block_size)
+{
+	cmp.block_size = block_size;
+	cmp.max_blocks = (max_buf_size / block_size) + 2;
+	cmp.bitmap = calloc((cmp.max_blocks + 63) / 64, sizeof(uint64_t));
+
+	if (cmp.bitmap == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for the compare bitmap\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	compare_kernel();
+
+	if (!IS_MODE(digest.open_mode, READ))
+		fprintf(flag.prst, "Compares blocks of src and dst with %s\n", cmp.kernel_name);
+}
+
+static void compare_mark(size_t i, bool dirty)
+{
+	if (dirty)
+		cmp.bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void compare_digest(struct dev *src_dev, struct dev *digest_dev)
+{
+	cmp.num_blocks = MIN(cmp.num_blocks, dev_loaded_blocks(digest_dev));
+
+	/* the pool keeps the hashes of consecutive blocks next to each other */
+	const char *hashes = (const char *)hash_pool_get(src_dev);
+	const char *stored = digest_dev->buf_data + digest_dev->rel_off;
+	char zero_hash[MAX(param.algo.size, 1)];
+
+	for (size_t i = 0; i < cmp.num_blocks; i++)
+	{
+		off_t off = src_dev->rel_off + i * cmp.block_size;
+		size_t size = MIN(cmp.block_size, src_dev->data_size - (src_dev->abs_off + i * cmp.block_size));
+		const char *hash = hashes + i * param.algo.size;
+
+		if (flag.sparse == 1 && buffer_is_zero(src_dev->buf_data + off, size))
+		{
+			sparse_zero_hash((void *)zero_hash, size);
+			hash = zero_hash;
+		}
+
+		compare_mark(i, memcmp(stored + i * digest_dev->block_size, hash, param.algo.size) != 0);
+	}
+}
+
+static void compare_dst(struct dev *src_dev, struct dev *dst_dev)
+{
+	size_t size = MIN(src_dev->buf_size - src_dev->rel_off, dst_dev->buf_size > (size_t)dst_dev->rel_off ? dst_dev->buf_size - dst_dev->rel_off : 0);
+
+	const char *a = src_dev->buf_data + src_dev->rel_off;
+	const char *b = dst_dev->buf_data + dst_dev->rel_off;
+
+	for (size_t i = 0; i < cmp.num_blocks; i++)
+	{
+		size_t off = i * cmp.block_size;
+		size_t block_size = MIN(cmp.block_size, src_dev->data_size - (src_dev->abs_off + off));
+
+		/* blocks the dst buffer does not cover are always written */
+		compare_mark(i, off + block_size > size || !cmp.equal(a + off, b + off, block_size));
+	}
+}
+
+void compare_run(struct dev *src_dev, struct dev *dst_dev, struct dev *digest_dev)
+{
+	if (cmp.bitmap == NULL)
+		return;
+
+	if (src_dev->abs_off >= cmp.base_off && src_dev->abs_off < cmp.end_off &&
+		src_dev->buf_off == cmp.src_buf_off && digest_dev->buf_off == cmp.digest_buf_off)
+		return;
+
+	cmp.base_off = src_dev->abs_off;
+	cmp.num_blocks = MIN(cmp.max_blocks, dev_loaded_blocks(src_dev));
+	cmp.src_buf_off = src_dev->buf_off;
+	cmp.digest_buf_off = digest_dev->buf_off;
+
+	memset(cmp.bitmap, 0, ((cmp.num_blocks + 63) / 64) * sizeof(uint64_t));
+
+	struct stats_clock clk;
+
+	stats_begin(&clk);
+
+	if (IS_MODE(digest_dev->open_mode, READ))
+		compare_digest(src_dev, digest_dev);
+	else
+		compare_dst(src_dev, dst_dev);
+
+	cmp.end_off = cmp.base_off + cmp.num_blocks * cmp.block_size;
+
+	stats_end(&clk, STATS_COMPARE, MIN(cmp.num_blocks * cmp.block_size, src_dev->data_size - src_dev->abs_off));
+}
+
+bool compare_dirty(struct dev *dev)
+{
+	size_t i = (dev->abs_off - cmp.base_off) / cmp.block_size;
+
+	return i >= cmp.num_blocks || (cmp.bitmap[i / 64] & ((uint64_t)1 << (i % 64))) != 0;
+}
+
+/* returns the number of unchanged blocks that follow the current one in the compared window */
+size_t compare_clean_run(struct dev *dev)
+{
+	size_t first = (dev->abs_off - cmp.base_off) / cmp.block_size + 1;
+	size_t i = first;
+
+	while (i < cmp.num_blocks)
+	{
+		uint64_t word = cmp.bitmap[i / 64] >> (i % 64);
+
+		if (word != 0)
+		{
+			i += __builtin_ctzll(word);
+			break;
+		}
+
+		i += 64 - (i % 64);
+	}
+
+	return MIN(i, cmp.num_blocks) - MIN(first, cmp.num_blocks);
+}
+
+/* compares two buffers with the kernel chosen by the CPU features, without a compare window */
+bool compare_equal(const char *a, const char *b, size_t size)
+{
+	if (cmp.equal == NULL)
+		compare_kernel();
+
+	return cmp.equal(a, b, size);
+}
+
+void compare_free(void)
+{
+	free(cmp.bitmap);
+	cmp.bitmap = NULL;
+}
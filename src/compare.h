@@ -0,0 +1,29 @@
+/*
+ ./src/compare.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef COMPARE_H
+#define COMPARE_H
+
+void compare_init(size_t max_buf_size, size_t block_size);
+void compare_run(struct dev *src_dev, struct dev *dst_dev, struct dev *digest_dev);
+bool compare_dirty(struct dev *dev);
+size_t compare_clean_run(struct dev *dev);
+bool compare_equal(const char *a, const char *b, size_t size);
+void compare_free(void);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ ./src/compress.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "compress.h"
+#include "stats.h"
+
+#include <pthread.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+/*
+ A compressed delta has the MAGIC_DELTA2 header with the codec set and the
+ records stream cut into frames, one per flushed delta buffer:
+
+ | raw size (uint32) | stored size (uint32) | stored data |
+
+ A frame with equal sizes is stored uncompressed, a frame with both sizes
+ set to 0 ends the stream. The frames are compressed and written by a worker
+ thread while make_delta() fills the next buffer.
+*/
+
+#define FRAME_HEADER_SIZE (2 * sizeof(uint32_t))
+#define MAX_FRAME_SIZE (1UL << 30)
+
+static struct codec_state
+{
+	int codec;
+	int level;
+	struct dev *dev;
+	off_t off;
+	size_t raw_bytes;
+	size_t stored_bytes;
+	size_t frames;
+
+	pthread_t worker;
+	bool worker_started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool busy;
+	bool quit;
+	int error;
+	char *spare;
+	char *job;
+	size_t job_size;
+
+	char *frame;
+	size_t frame_size;
+	char *out;
+	size_t out_size;
+	size_t out_len;
+	size_t out_pos;
+	bool eof;
+} codec = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *codec_names[] = {"none", "zstd", "lz4"};
+
+const char *codec_name(int codec_id)
+{
+	if (codec_id < CODEC_NONE || codec_id > CODEC_LZ4)
+		return "unknown";
+
+	return codec_names[codec_id];
+}
+
+bool codec_supported(int codec_id)
+{
+	switch (codec_id)
+	{
+	case CODEC_NONE:
+		return true;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return true;
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+void codec_parse(const char *arg)
+{
+	const char *sep = strchr(arg, ':');
+	size_t len = sep != NULL ? (size_t)(sep - arg) : strlen(arg);
+
+	param.codec = -1;
+
+	for (int i = CODEC_NONE; i <= CODEC_LZ4; i++)
+		if (strlen(codec_names[i]) == len && strncasecmp(arg, codec_names[i], len) == 0)
+			param.codec = i;
+
+	if (param.codec < 0)
+	{
+		fprintf(stderr, "%s: invalid compression '%s', use zstd or lz4 with an optional :level\n", process_name, arg);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (!codec_supported(param.codec))
+	{
+		fprintf(stderr, "%s: compression '%s' is not available in this build\n", process_name, codec_name(param.codec));
+		cleanup(EXIT_FAILURE);
+	}
+
+	param.codec_level = sep != NULL ? atoi(sep + 1) : 0;
+}
+
+static size_t compress_bound(size_t size)
+{
+	switch (codec.codec)
+	{
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return LZ4_compressBound(size);
+#endif
+	default:
+		return size;
+	}
+}
+
+/* returns the size of the compressed data or 0 when it should be stored as is */
+static size_t compress_chunk(char *dst, size_t dst_size, const char *src, size_t size)
+{
+	(void)dst;
+	(void)dst_size;
+	(void)src;
+	(void)size;
+
+	switch (codec.codec)
+	{
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+	{
+		size_t res = ZSTD_compress(dst, dst_size, src, size, codec.level > 0 ? codec.level : ZSTD_CLEVEL_DEFAULT);
+		return ZSTD_isError(res) ? 0 : res;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+	{
+		int res = codec.level > 1 ? LZ4_compress_HC(src, dst, size, dst_size, codec.level)
+								  : LZ4_compress_default(src, dst, size, dst_size);
+		return res > 0 ? (size_t)res : 0;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+static bool decompress_chunk(char *dst, size_t dst_size, const char *src, size_t size)
+{
+	(void)dst;
+	(void)dst_size;
+	(void)src;
+	(void)size;
+
+	switch (codec.codec)
+	{
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return ZSTD_decompress(dst, dst_size, src, size) == dst_size;
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return LZ4_decompress_safe(src, dst, size, dst_size) == (int)dst_size;
+#endif
+	default:
+		return false;
+	}
+}
+
+static int write_frame(const char *data, size_t raw_size, size_t stored_size)
+{
+	uint32_t sizes[2] = {raw_size, stored_size};
+
+	memcpy(codec.frame, sizes, FRAME_HEADER_SIZE);
+
+	if (data != NULL && data != codec.frame + FRAME_HEADER_SIZE)
+		memcpy(codec.frame + FRAME_HEADER_SIZE, data, stored_size);
+
+	size_t size = FRAME_HEADER_SIZE + stored_size;
+
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t wbytes;
+		struct stats_clock clk;
+
+		stats_begin(&clk);
+
+		if (IS_MODE(codec.dev->open_mode, PIPE))
+			wbytes = write(codec.dev->fd, codec.frame + done, size - done);
+		else
+			wbytes = pwrite(codec.dev->fd, codec.frame + done, size - done, codec.off + done);
+
+		if (wbytes < 0 && errno == EINTR)
+			continue;
+
+		if (wbytes < 0)
+			return errno;
+
+		stats_io(codec.dev, STATS_WRITE, wbytes, &clk);
+
+		done += wbytes;
+	}
+
+	codec.off += size;
+	codec.raw_bytes += raw_size;
+	codec.stored_bytes += size;
+
+	/* the end marker is not counted as a frame */
+	if (raw_size > 0)
+		codec.frames++;
+
+	return 0;
+}
+
+static int compress_frame(const char *data, size_t size)
+{
+	size_t stored = compress_chunk(codec.frame + FRAME_HEADER_SIZE, codec.frame_size - FRAME_HEADER_SIZE, data, size);
+
+	if (stored == 0 || stored >= size)
+		return write_frame(data, size, size);
+
+	return write_frame(codec.frame + FRAME_HEADER_SIZE, size, stored);
+}
+
+static void *compress_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&codec.lock);
+
+	while (true)
+	{
+		while (!codec.busy && !codec.quit)
+			pthread_cond_wait(&codec.cond, &codec.lock);
+
+		if (!codec.busy && codec.quit)
+			break;
+
+		char *job = codec.job;
+		size_t job_size = codec.job_size;
+		pthread_mutex_unlock(&codec.lock);
+
+		int error = compress_frame(job, job_size);
+
+		pthread_mutex_lock(&codec.lock);
+
+		if (error != 0 && codec.error == 0)
+			codec.error = error;
+
+		codec.spare = job;
+		codec.job = NULL;
+		codec.busy = false;
+		pthread_cond_broadcast(&codec.cond);
+	}
+
+	pthread_mutex_unlock(&codec.lock);
+
+	return NULL;
+}
+
+/* waits for the frame in progress, called with the lock held */
+static void compress_wait(void)
+{
+	while (codec.busy)
+		pthread_cond_wait(&codec.cond, &codec.lock);
+
+	if (codec.error != 0)
+	{
+		int error = codec.error;
+		pthread_mutex_unlock(&codec.lock);
+
+		fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name,
+				IS_MODE(codec.dev->open_mode, PIPE) ? "stdout" : codec.dev->path, strerror(error));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+void compress_init(struct dev *dev, size_t max_chunk_size)
+{
+	codec.codec = param.codec;
+	codec.level = param.codec_level;
+	codec.dev = dev;
+	codec.off = HEADER_SIZE;
+
+	codec.spare = malloc(max_chunk_size);
+	codec.frame_size = FRAME_HEADER_SIZE + MAX(compress_bound(max_chunk_size), max_chunk_size);
+	codec.frame = malloc(codec.frame_size);
+
+	if (codec.spare == NULL || codec.frame == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for delta compression\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (pthread_create(&codec.worker, NULL, compress_worker, NULL) != 0)
+	{
+		fprintf(stderr, "%s: unable to start compression thread\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	codec.worker_started = true;
+
+	fprintf(flag.prst, "Compression: %s", codec_name(codec.codec));
+
+	if (codec.level > 0)
+		fprintf(flag.prst, " level %d", codec.level);
+
+	fprintf(flag.prst, "\n");
+}
+
+void compress_submit(struct dev *dev)
+{
+	(void)dev;
+
+	pthread_mutex_lock(&codec.lock);
+	compress_wait();
+
+	/* the filled buffer goes to the worker, make_delta() continues with the spare one */
+	codec.job = oper.delta_buf;
+	codec.job_size = oper.delta_wri_buf_size;
+	oper.delta_buf = codec.spare;
+	codec.spare = NULL;
+	codec.busy = true;
+
+	pthread_cond_broadcast(&codec.cond);
+	pthread_mutex_unlock(&codec.lock);
+}
+
+void compress_finish(struct dev *dev)
+{
+	pthread_mutex_lock(&codec.lock);
+	compress_wait();
+	pthread_mutex_unlock(&codec.lock);
+
+	int error = write_frame(NULL, 0, 0);
+
+	if (error != 0)
+	{
+		fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name,
+				IS_MODE(dev->open_mode, PIPE) ? "stdout" : dev->path, strerror(error));
+		cleanup(EXIT_FAILURE);
+	}
+
+	dev->data_size = codec.off;
+}
+
+void compress_print_stats(void)
+{
+	if (codec.worker_started && codec.raw_bytes > 0)
+		fprintf(flag.prst, "Compressed: %s to %s in %zu frames (%s)\n", format_units(codec.raw_bytes, false),
+				format_units(codec.stored_bytes, false), codec.frames, codec_name(codec.codec));
+}
+
+static size_t read_full(struct dev *dev, void *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t rbytes;
+		struct stats_clock clk;
+
+		stats_begin(&clk);
+
+		if (IS_MODE(dev->open_mode, PIPE))
+			rbytes = read(dev->fd, (char *)buf + done, size - done);
+		else
+			rbytes = pread(dev->fd, (char *)buf + done, size - done, codec.off + done);
+
+		if (rbytes < 0 && errno == EINTR)
+			continue;
+
+		if (rbytes < 0)
+		{
+			fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name,
+					IS_MODE(dev->open_mode, PIPE) ? "stdin" : dev->path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		stats_io(dev, STATS_READ, rbytes, &clk);
+
+		if (rbytes == 0)
+			break;
+
+		done += rbytes;
+	}
+
+	codec.off += done;
+
+	return done;
+}
+
+static void delta_invalid(void)
+{
+	fprintf(stderr, "%s: delta data is invalid\n", process_name);
+	cleanup(EXIT_FAILURE);
+}
+
+void decompress_init(struct dev *dev)
+{
+	codec.codec = dev->codec;
+	codec.dev = dev;
+	codec.off = HEADER_SIZE;
+}
+
+/* decodes the next frame into codec.out, returns false at the end of the stream */
+static bool decompress_frame(struct dev *dev)
+{
+	uint32_t sizes[2];
+
+	if (codec.eof)
+		return false;
+
+	if (read_full(dev, sizes, FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE || sizes[0] > MAX_FRAME_SIZE || sizes[1] > sizes[0])
+		delta_invalid();
+
+	if (sizes[0] == 0)
+	{
+		codec.eof = true;
+		return false;
+	}
+
+	if (sizes[0] > codec.out_size)
+	{
+		codec.out = realloc(codec.out, sizes[0]);
+		codec.frame = realloc(codec.frame, sizes[0]);
+		codec.out_size = sizes[0];
+
+		if (codec.out == NULL || codec.frame == NULL)
+		{
+			fprintf(stderr, "%s: unable to allocate memory for delta decompression\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	char *stored = sizes[1] == sizes[0] ? codec.out : codec.frame;
+
+	if (read_full(dev, stored, sizes[1]) != sizes[1])
+		delta_invalid();
+
+	if (stored != codec.out && !decompress_chunk(codec.out, sizes[0], stored, sizes[1]))
+		delta_invalid();
+
+	codec.out_len = sizes[0];
+	codec.out_pos = 0;
+
+	return true;
+}
+
+void decompress_buffer(struct dev *dev)
+{
+	size_t filled = 0;
+
+	while (filled < dev->max_buf_size)
+	{
+		if (codec.out_pos == codec.out_len && !decompress_frame(dev))
+			break;
+
+		size_t size = MIN(codec.out_len - codec.out_pos, dev->max_buf_size - filled);
+		memcpy(dev->buf_data + filled, codec.out + codec.out_pos, size);
+
+		codec.out_pos += size;
+		filled += size;
+	}
+
+	dev->buf_size = filled;
+
+	if (filled < dev->max_buf_size)
+		dev->data_size = dev->abs_off + filled;
+}
+
+void decompress_info(struct dev *dev)
+{
+	uint32_t sizes[2] = {0, 0};
+	size_t raw_size = 0, frames = 0;
+	bool complete = false;
+
+	codec.off = HEADER_SIZE;
+
+	while (read_full(dev, sizes, FRAME_HEADER_SIZE) == FRAME_HEADER_SIZE)
+	{
+		if (sizes[0] == 0)
+		{
+			complete = true;
+			break;
+		}
+
+		raw_size += sizes[0];
+		codec.off += sizes[1];
+		frames++;
+	}
+
+	fprintf(flag.prst, "Uncompressed size: %s in %zu frames\n", format_units(HEADER_SIZE + raw_size, true), frames);
+
+	if (!complete || codec.off > (off_t)dev->data_size)
+		fprintf(flag.prst, "Warning: compressed delta data is truncated\n");
+}
+
+void codec_free(void)
+{
+	if (codec.worker_started)
+	{
+		pthread_mutex_lock(&codec.lock);
+
+		while (codec.busy)
+			pthread_cond_wait(&codec.cond, &codec.lock);
+
+		codec.quit = true;
+		pthread_cond_broadcast(&codec.cond);
+		pthread_mutex_unlock(&codec.lock);
+
+		pthread_join(codec.worker, NULL);
+		codec.worker_started = false;
+	}
+
+	free(codec.spare);
+	free(codec.frame);
+	free(codec.out);
+
+	codec.spare = codec.frame = codec.out = NULL;
+}
@@ -0,0 +1,34 @@
+/*
+ ./src/compress.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+void codec_parse(const char *arg);
+const char *codec_name(int codec);
+bool codec_supported(int codec);
+void compress_init(struct dev *dev, size_t max_chunk_size);
+void compress_submit(struct dev *dev);
+void compress_finish(struct dev *dev);
+void compress_print_stats(void);
+void decompress_init(struct dev *dev);
+void decompress_buffer(struct dev *dev);
+void decompress_info(struct dev *dev);
+void codec_free(void);
+
+#endif
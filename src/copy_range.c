@@ -0,0 +1,124 @@
+/*
+ ./src/copy_range.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "copy_range.h"
+
+#include <linux/fs.h> // FICLONERANGE
+
+/*
+ When src and dst of a block-sync are regular files on one filesystem, the
+ changed runs are handed to the kernel instead of being written from the src
+ buffer. FICLONERANGE shares the extents of src with dst on filesystems with
+ reflinks like btrfs or XFS, so the synced image takes no new space. Other
+ filesystems get copy_file_range(), which at least keeps the data out of
+ userspace. A run which none of them takes is written with pwrite() as before,
+ and a method which the filesystem refuses is not tried again.
+*/
+
+static struct copy_range
+{
+	bool clone;
+	bool copy;
+	size_t cloned_bytes;
+	size_t copied_bytes;
+} cr = {false, false, 0, 0};
+
+void copy_range_init(void)
+{
+	if (flag.oper_mode != BLOCKSYNC || !IS_MODE(src.open_mode, DIRECT_R) || !IS_MODE(dst.open_mode, DIRECT_W))
+		return;
+
+	if (!S_ISREG(src.stat.st_mode) || !S_ISREG(dst.stat.st_mode) || src.stat.st_dev != dst.stat.st_dev)
+		return;
+
+	/* reflinks share whole filesystem blocks, only the tail of the file may be shorter */
+	cr.clone = dst.stat.st_blksize > 0 && param.block_size % dst.stat.st_blksize == 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	cr.copy = true;
+#endif
+
+	if (cr.clone || cr.copy)
+		fprintf(flag.prst, "Src and dst are files on one filesystem, changed blocks are %s by the kernel\n",
+				cr.clone ? "cloned or copied" : "copied");
+}
+
+/* returns false when the run has to be written from the src buffer */
+bool copy_range_write(size_t size, off_t off)
+{
+	if (cr.clone)
+	{
+		struct file_clone_range range = {src.fd, off, size, off};
+
+		if (ioctl(dst.fd, FICLONERANGE, &range) == 0)
+		{
+			cr.cloned_bytes += size;
+			return true;
+		}
+
+		/* EINVAL is an unaligned run, anything else means no reflinks between these files */
+		if (errno != EINVAL)
+			cr.clone = false;
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (cr.copy)
+	{
+		loff_t src_off = off;
+		loff_t dst_off = off;
+		size_t left = size;
+		ssize_t cbytes = 0;
+
+		while (left > 0 && (cbytes = copy_file_range(src.fd, &src_off, dst.fd, &dst_off, left, 0)) > 0)
+			left -= cbytes;
+
+		if (left == 0)
+		{
+			cr.copied_bytes += size;
+			return true;
+		}
+
+		if (cbytes < 0 && errno != EINTR && errno != EAGAIN)
+			cr.copy = false;
+	}
+#endif
+
+	return false;
+}
+
+void copy_range_save_stats(struct job_stats *js)
+{
+	js->cloned_bytes = cr.cloned_bytes;
+	js->copied_bytes = cr.copied_bytes;
+}
+
+void copy_range_merge_stats(const struct job_stats *js)
+{
+	cr.cloned_bytes += js->cloned_bytes;
+	cr.copied_bytes += js->copied_bytes;
+}
+
+void copy_range_print_stats(void)
+{
+	if (cr.cloned_bytes == 0 && cr.copied_bytes == 0)
+		return;
+
+	fprintf(flag.prst, "Copy range: %s cloned, ", format_units(cr.cloned_bytes, false));
+	fprintf(flag.prst, "%s copied by the kernel\n", format_units(cr.copied_bytes, false));
+}
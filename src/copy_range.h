@@ -0,0 +1,28 @@
+/*
+ ./src/copy_range.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef COPY_RANGE_H
+#define COPY_RANGE_H
+
+void copy_range_init(void);
+bool copy_range_write(size_t size, off_t off);
+void copy_range_save_stats(struct job_stats *js);
+void copy_range_merge_stats(const struct job_stats *js);
+void copy_range_print_stats(void);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ ./src/digest_cache.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "digest_cache.h"
+#include "uring.h"
+#include "readahead.h"
+
+#include <stddef.h>
+#include <limits.h>
+
+/*
+ With --digest-cache=DIR a block-sync without -f uses a digest file from DIR
+ named after the identity of the target: the device number of a block device,
+ or the device and inode of an image file, and the data size. When the run
+ finishes, the digest header is stamped with the nanosecond mtime and ctime,
+ the inode and the size of the target and the time of the stamp. The next run
+ uses the digest only when all of them still match and the digest was made for
+ the same size, block size and hash algorithm, otherwise the stale digest is
+ removed and the target is read once more.
+
+ A write within the same timestamp tick does not change the mtime, so a stamp
+ taken less than the timestamp granularity after the mtime is never trusted.
+
+ The times of a block device node do not change when the device is written,
+ so a digest of a block device would be trusted after any foreign write. Its
+ cache is used only with --digest-cache-blkdev, otherwise it is rebuilt by
+ every run.
+*/
+
+static struct digest_cache
+{
+	bool active;
+	char path[PATH_MAX];
+} cache = {false, ""};
+
+static uint64_t digest_cache_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* the timestamp granularity of the filesystem, whole seconds when it does not store nanoseconds */
+static uint64_t digest_cache_granularity(const struct stat *st)
+{
+	struct timespec res;
+
+	if (st->st_mtim.tv_nsec == 0 || clock_getres(CLOCK_REALTIME_COARSE, &res) < 0)
+		return 2000000000ULL;
+
+	return digest_cache_ns(&res);
+}
+
+static bool digest_cache_valid(void)
+{
+	struct bsf_header header;
+	int fd = open(cache.path, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	ssize_t rbytes = pread(fd, &header, sizeof(header), 0);
+	close(fd);
+
+	if (rbytes != (ssize_t)sizeof(header) || memcmp(header.recognize, (const void *)(MAGIC_DIGEST), sizeof(MAGIC_DIGEST)) != 0)
+		return false;
+
+	if (header.data_size != src.data_size || header.block_size != param.block_size ||
+		(header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)) != (uint64_t)param.algo.value)
+		return false;
+
+	/* an interrupted run leaves the start time in the header, --resume continues it from the checkpoint */
+	if (flag.resume == 1 && header.resume_off > 0)
+		return true;
+
+	uint64_t mtime = digest_cache_ns(&dst.stat.st_mtim);
+	uint64_t ctime = digest_cache_ns(&dst.stat.st_ctim);
+
+	return header.cache_mtime == mtime && header.cache_ctime == ctime &&
+		   header.cache_ino == (uint64_t)dst.stat.st_ino && header.cache_size == (uint64_t)dst.stat.st_size &&
+		   header.cache_stamped >= MAX(mtime, ctime) + digest_cache_granularity(&dst.stat);
+}
+
+void digest_cache_init(void)
+{
+	if (param.digest_cache == NULL || digest.path != NULL || param.remote != NULL)
+		return;
+
+	if (mkdir(param.digest_cache, S_IRWXU) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "%s: unable to create digest cache directory '%s': %s\n", process_name, param.digest_cache, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	unsigned long dev = S_ISBLK(dst.stat.st_mode) ? dst.stat.st_rdev : dst.stat.st_dev;
+	unsigned long ino = S_ISBLK(dst.stat.st_mode) ? 0 : dst.stat.st_ino;
+
+	if (snprintf(cache.path, sizeof(cache.path), "%s/%lx-%lx-%zu.digest", param.digest_cache, dev, ino, src.data_size) >= (int)sizeof(cache.path))
+	{
+		fprintf(stderr, "%s: digest cache directory path is too long\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	bool blkdev_stale = S_ISBLK(dst.stat.st_mode) && flag.digest_cache_blkdev == 0;
+
+	if (blkdev_stale)
+		fprintf(flag.prst, "Warning: the digest cache of block device '%s' is not reused, writes do not change its times, "
+						   "add --digest-cache-blkdev when only block-sync writes it\n", dst.path);
+
+	if (access(cache.path, F_OK) == 0 && (blkdev_stale || !IS_MODE(dst.open_mode, READ) || !digest_cache_valid()))
+	{
+		fprintf(flag.prst, "Digest cache: '%s' is stale, the target will be read\n", cache.path);
+
+		if (unlink(cache.path) < 0)
+		{
+			fprintf(stderr, "%s: unable to remove digest cache '%s': %s\n", process_name, cache.path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	digest.path = cache.path;
+	cache.active = true;
+}
+
+/* stamps the digest with the identity and times of the target once all writes are done */
+void digest_cache_finish(void)
+{
+	if (!cache.active || flag.dont_write != 0)
+		return;
+
+	struct stat st;
+
+	uring_wait();
+	readahead_drain();
+
+	if (IS_MODE(dst.open_mode, MMAP_W) && dst.buf_data != NULL)
+		msync(dst.buf_data, dst.buf_size, MS_SYNC);
+
+	if (fstat(dst.fd, &st) < 0)
+	{
+		fprintf(stderr, "%s: unable to stat target device '%s': %s\n", process_name, dst.path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	uint64_t stamp[5] = {digest_cache_ns(&st.st_mtim), digest_cache_ns(&st.st_ctim), st.st_ino, st.st_size, digest_cache_ns(&now)};
+
+	if (pwrite(digest.fd, (const void *)stamp, sizeof(stamp), offsetof(struct bsf_header, cache_mtime)) < 0)
+	{
+		fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, digest.path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
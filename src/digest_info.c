@@ -17,6 +17,9 @@
 */
 
 #include "globals.h"
+#include "digest_tree.h"
+#include "compress.h"
+#include "compare.h"
 
 void digest_info(void)
 {
@@ -106,12 +109,20 @@ void digest_info(void)
 			break;
 		}
 
-		if (digest_header.hash_type == algos[i].value)
+		if ((digest_header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)) == algos[i].value)
 		{
 			fprintf(flag.prst, "Hash algo: %s\n", algos[i].symbol);
 			break;
 		}
 	}
+
+	fprintf(flag.prst, "Digest format: %s\n", (digest_header.hash_type & DIGEST_TREE) ? "tree" : "flat");
+
+	if (digest_header.hash_type & DIGEST_TREE)
+		digest_tree_info();
+
+	if (digest_header.hash_type & DIGEST_COARSE)
+		fprintf(flag.prst, "Coarse hashes: %lu ranges of %s\n", (digest_header.data_size + COARSE_SIZE - 1) / COARSE_SIZE, format_units(COARSE_SIZE, false));
 }
 
 void delta_info(void)
@@ -172,7 +183,16 @@ void delta_info(void)
 
 	delta_read_header();
 
-	if (memcmp(delta_header.recognize, (const void *)(MAGIC_DELTA), sizeof(MAGIC_DELTA)) != 0 || delta.data_size < HEADER_SIZE || delta_header.block_size < 1)
+	bool delta2 = memcmp(delta_header.recognize, (const void *)(MAGIC_DELTA2), sizeof(MAGIC_DELTA2)) == 0;
+
+	if (!delta2)
+	{
+		delta_header.codec = CODEC_NONE;
+		delta_header.format = DELTA_BLOCKS;
+	}
+
+	if ((!delta2 && memcmp(delta_header.recognize, (const void *)(MAGIC_DELTA), sizeof(MAGIC_DELTA)) != 0) ||
+		delta.data_size < HEADER_SIZE || delta_header.block_size < 1 || delta_header.codec > CODEC_LZ4 || delta_header.format > DELTA_EXTENTS)
 	{
 		fprintf(stderr, "%s: delta file '%s' is invalid\n", process_name, delta.path);
 		cleanup(EXIT_FAILURE);
@@ -192,4 +212,278 @@ void delta_info(void)
 
 	strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", dt);
 	fprintf(flag.prst, "Create time: %s\n", timestr);
+	fprintf(flag.prst, "Delta format: %s\n", (delta_header.format == DELTA_EXTENTS ? "extents" : "blocks"));
+	fprintf(flag.prst, "Compression: %s\n", codec_name(delta_header.codec));
+
+	if (delta_header.codec != CODEC_NONE)
+		decompress_info(&delta);
+}
+
+struct compared_digest
+{
+	const char *path;
+	int fd;
+	struct bsf_header header;
+	char *buf;
+	off_t size;
+	char *levels[TREE_LEVELS + 1];
+};
+
+/* run of differing blocks and totals of the comparison */
+static struct digest_diff
+{
+	size_t extents;
+	size_t changed;
+	size_t changed_bytes;
+	size_t run_first;
+	bool in_run;
+	size_t hashes;
+} diff = {0};
+
+/* layout of the tree levels, level 0 are the block hashes */
+static struct digest_levels
+{
+	size_t fanout[TREE_LEVELS];
+	size_t count[TREE_LEVELS + 1];
+	size_t span[TREE_LEVELS + 1];
+	off_t off[TREE_LEVELS + 1];
+} levels = {0};
+
+static void compare_digests_open(struct compared_digest *cd)
+{
+	struct stat st;
+
+	if ((cd->fd = open(cd->path, O_RDONLY)) < 0 || fstat(cd->fd, &st) < 0)
+	{
+		fprintf(stderr, "%s: unable to open digest file \'%s\': %s\n", process_name, cd->path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (pread(cd->fd, &cd->header, sizeof(cd->header), 0) != (ssize_t)sizeof(cd->header) ||
+		memcmp(cd->header.recognize, (const void *)(MAGIC_DIGEST), sizeof(MAGIC_DIGEST)) != 0 || cd->header.block_size < 1)
+	{
+		fprintf(stderr, "%s: digest file '%s' is invalid\n", process_name, cd->path);
+		cleanup(EXIT_FAILURE);
+	}
+
+	long num_blocks = (cd->header.data_size + cd->header.block_size - 1) / cd->header.block_size;
+
+	for (int i = 0; algos[i].value != 0; i++)
+		if ((cd->header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)) == (uint64_t)algos[i].value)
+			param.algo = algos[i];
+
+	if ((cd->header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)) != (uint64_t)param.algo.value ||
+		(size_t)st.st_size < HEADER_SIZE + num_blocks * param.algo.size)
+	{
+		fprintf(stderr, "%s: digest file '%s' is invalid\n", process_name, cd->path);
+		cleanup(EXIT_FAILURE);
+	}
+
+	cd->size = st.st_size;
+
+	if (cd->header.resume_off > 0)
+		fprintf(flag.prst, "Warning: digest file '%s' is of an interrupted run, its hashes from %s on may be stale\n",
+				cd->path, format_units(cd->header.resume_off, true));
+}
+
+static void compare_digests_read(struct compared_digest *cd, char *buf, size_t size, off_t off)
+{
+	if (pread(cd->fd, buf, size, off) != (ssize_t)size)
+	{
+		fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name, cd->path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+/* prints the extent of the run of differing blocks which ends before block end and returns its length */
+static size_t compare_digests_extent(size_t first, size_t end)
+{
+	size_t off = first * param.block_size;
+	size_t len = MIN(end * param.block_size, param.data_size) - off;
+
+	printf("%zu %zu\n", off, len);
+
+	return len;
+}
+
+/* opens or closes the run of differing blocks at block, blocks are marked in ascending order */
+static void compare_digests_mark(size_t block, bool equal)
+{
+	if (!equal && !diff.in_run)
+	{
+		diff.run_first = block;
+		diff.in_run = true;
+	}
+	else if (equal && diff.in_run)
+	{
+		diff.changed_bytes += compare_digests_extent(diff.run_first, block);
+		diff.changed += block - diff.run_first;
+		diff.extents++;
+		diff.in_run = false;
+	}
+}
+
+static void compare_digests_flat(struct compared_digest *a, struct compared_digest *b)
+{
+	size_t hash_size = param.algo.size;
+	size_t chunk_hashes = MAX(param.max_buf_size / hash_size, 64UL);
+
+	/* the hashes are read once in large sequential chunks */
+	posix_fadvise(a->fd, HEADER_SIZE, param.num_blocks * hash_size, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(b->fd, HEADER_SIZE, param.num_blocks * hash_size, POSIX_FADV_SEQUENTIAL);
+
+	a->buf = malloc(chunk_hashes * hash_size);
+	b->buf = malloc(chunk_hashes * hash_size);
+
+	if (a->buf == NULL || b->buf == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for digest buffers\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	for (size_t first = 0; first < param.num_blocks; first += chunk_hashes)
+	{
+		size_t count = MIN(chunk_hashes, param.num_blocks - first);
+
+		compare_digests_read(a, a->buf, count * hash_size, HEADER_SIZE + first * hash_size);
+		compare_digests_read(b, b->buf, count * hash_size, HEADER_SIZE + first * hash_size);
+		diff.hashes += count;
+
+		/* equal groups of 64 hashes are passed at once, only the others are compared hash by hash */
+		for (size_t group = 0; group < count; group += 64)
+		{
+			size_t group_count = MIN(64UL, count - group);
+			size_t off = group * hash_size;
+
+			if (!diff.in_run && compare_equal(a->buf + off, b->buf + off, group_count * hash_size))
+				continue;
+
+			for (size_t i = group; i < group + group_count; i++)
+				compare_digests_mark(first + i, memcmp(a->buf + i * hash_size, b->buf + i * hash_size, hash_size) == 0);
+		}
+	}
+
+	free(a->buf);
+	free(b->buf);
+}
+
+/* a tree is used only when it is complete and was written after all of the block hashes */
+static bool compare_digests_has_tree(struct compared_digest *cd)
+{
+	return (cd->header.hash_type & DIGEST_TREE) && cd->header.resume_off == 0 &&
+		   cd->size >= levels.off[TREE_LEVELS] + (off_t)(levels.count[TREE_LEVELS] * param.algo.size);
+}
+
+/* compares num nodes of a level from node first on and descends only into the differing ones */
+static void compare_digests_level(struct compared_digest *a, struct compared_digest *b, int level, size_t first, size_t num)
+{
+	size_t hash_size = param.algo.size;
+
+	compare_digests_read(a, a->levels[level], num * hash_size, levels.off[level] + first * hash_size);
+	compare_digests_read(b, b->levels[level], num * hash_size, levels.off[level] + first * hash_size);
+	diff.hashes += num;
+
+	for (size_t i = 0; i < num; i++)
+	{
+		size_t node = first + i;
+
+		if (memcmp(a->levels[level] + i * hash_size, b->levels[level] + i * hash_size, hash_size) == 0)
+			compare_digests_mark(node * levels.span[level], true);
+		else if (level == 0)
+			compare_digests_mark(node, false);
+		else
+		{
+			size_t child = node * levels.fanout[level - 1];
+			compare_digests_level(a, b, level - 1, child, MIN(levels.fanout[level - 1], levels.count[level - 1] - child));
+		}
+	}
+}
+
+static void compare_digests_tree(struct compared_digest *a, struct compared_digest *b)
+{
+	size_t hash_size = param.algo.size;
+
+	for (int i = 0; i <= TREE_LEVELS; i++)
+	{
+		size_t nodes = MAX((i == TREE_LEVELS ? levels.count[i] : levels.fanout[i]), 1UL);
+
+		a->levels[i] = malloc(nodes * hash_size);
+		b->levels[i] = malloc(nodes * hash_size);
+
+		if (a->levels[i] == NULL || b->levels[i] == NULL)
+		{
+			fprintf(stderr, "%s: unable to allocate memory for digest buffers\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	compare_digests_level(a, b, TREE_LEVELS, 0, levels.count[TREE_LEVELS]);
+
+	for (int i = 0; i <= TREE_LEVELS; i++)
+	{
+		free(a->levels[i]);
+		free(b->levels[i]);
+	}
+}
+
+void compare_digests(void)
+{
+	struct compared_digest a = {.path = param.compare_digests[0], .fd = -1};
+	struct compared_digest b = {.path = param.compare_digests[1], .fd = -1};
+
+	fprintf(flag.prst, "Operation mode: compare-digests\n");
+
+	if (a.path == NULL || b.path == NULL)
+	{
+		fprintf(stderr, "%s - you need to specify two digest paths (--compare-digests A B)\n", process_name);
+		fprintf(flag.prst, "Try '%s --help' for more information.\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	compare_digests_open(&a);
+	compare_digests_open(&b);
+
+	if (a.header.data_size != b.header.data_size || a.header.block_size != b.header.block_size ||
+		(a.header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)) != (b.header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)))
+	{
+		fprintf(stderr, "%s: digest files '%s' and '%s' differ in device size, block size or hash algo\n", process_name, a.path, b.path);
+		cleanup(EXIT_FAILURE);
+	}
+
+	param.data_size = a.header.data_size;
+	param.block_size = a.header.block_size;
+	param.num_blocks = (param.data_size + param.block_size - 1) / param.block_size;
+
+	digest_tree_layout(param.num_blocks, param.block_size, levels.fanout, levels.count);
+	levels.span[0] = 1;
+	levels.off[0] = HEADER_SIZE;
+
+	for (int i = 1; i <= TREE_LEVELS; i++)
+	{
+		levels.span[i] = levels.span[i - 1] * levels.fanout[i - 1];
+		levels.off[i] = levels.off[i - 1] + levels.count[i - 1] * param.algo.size;
+	}
+
+	fprintf(flag.prst, "Digest files: '%s' and '%s' of %s in %zu blocks of ", a.path, b.path, format_units(param.data_size, true), param.num_blocks);
+	fprintf(flag.prst, "%s with '%s'\n", format_units(param.block_size, true), param.algo.symbol);
+
+	bool tree = compare_digests_has_tree(&a) && compare_digests_has_tree(&b);
+
+	if (tree)
+		compare_digests_tree(&a, &b);
+	else
+		compare_digests_flat(&a, &b);
+
+	compare_digests_mark(param.num_blocks, true);
+
+	fflush(stdout);
+
+	if (tree)
+		fprintf(flag.prst, "Digest trees: compared %zu hashes top-down\n", diff.hashes);
+
+	fprintf(flag.prst, "Differs: %zu/%zu blocks in %zu extents, ", diff.changed, param.num_blocks, diff.extents);
+	fprintf(flag.prst, "%s\n", format_units(diff.changed_bytes, true));
+
+	close(a.fd);
+	close(b.fd);
 }
@@ -21,5 +21,6 @@
 
 void digest_info(void);
 void delta_info(void);
+void compare_digests(void);
 
 #endif
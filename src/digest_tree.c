@@ -0,0 +1,233 @@
+/*
+ ./src/digest_tree.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "digest_tree.h"
+#include "coarse.h"
+
+/*
+ A tree digest keeps the flat array of block hashes and appends parent levels
+ covering 1 MiB, 64 MiB and 4 GiB of the device. A parent is the hash of the
+ concatenated hashes of its children, so two digests can be compared from the
+ top level down, descending only into the ranges which differ.
+
+ | header | block hashes | 1 MiB nodes | 64 MiB nodes | 4 GiB nodes |
+
+ Such a digest is marked with DIGEST_TREE in hash_type, which older versions
+ treat as an unsupported hash algorithm.
+*/
+
+static const size_t tree_spans[TREE_LEVELS] = {1UL << 20, 1UL << 26, 1UL << 32};
+
+static struct digest_tree
+{
+	int hash_size;
+	size_t fanout[TREE_LEVELS];
+	size_t count[TREE_LEVELS + 1];
+	char *levels[TREE_LEVELS];
+	char *stage;
+	size_t staged;
+	size_t nodes;
+} tree = {0};
+
+void digest_tree_layout(size_t num_blocks, size_t block_size, size_t fanout[], size_t count[])
+{
+	count[0] = num_blocks;
+
+	for (int i = 0; i < TREE_LEVELS; i++)
+	{
+		size_t span = (i == 0 ? block_size : tree_spans[i - 1]);
+
+		fanout[i] = MAX(tree_spans[i] / span, 1);
+		count[i + 1] = (count[i] + fanout[i] - 1) / fanout[i];
+	}
+}
+
+size_t digest_tree_size(size_t num_blocks, size_t block_size, int hash_size)
+{
+	size_t fanout[TREE_LEVELS], count[TREE_LEVELS + 1], size = 0;
+
+	digest_tree_layout(num_blocks, block_size, fanout, count);
+
+	for (int i = 1; i <= TREE_LEVELS; i++)
+		size += count[i] * hash_size;
+
+	return size;
+}
+
+void digest_tree_init(void)
+{
+	tree.hash_size = param.algo.size;
+	digest_tree_layout(param.num_blocks, param.block_size, tree.fanout, tree.count);
+
+	tree.stage = malloc(tree.fanout[0] * tree.hash_size);
+
+	for (int i = 0; i < TREE_LEVELS; i++)
+		tree.levels[i] = malloc(tree.count[i + 1] * tree.hash_size);
+
+	if (tree.stage == NULL || tree.levels[0] == NULL || tree.levels[1] == NULL || tree.levels[2] == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for the digest tree\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	fprintf(flag.prst, "Digest tree: %zu + %zu + %zu nodes over 1 MiB, 64 MiB and 4 GiB ranges\n",
+			tree.count[1], tree.count[2], tree.count[3]);
+}
+
+static void tree_hash_node(int level, size_t node, const char *children, size_t num_children)
+{
+	hash_buffer(param.algo.value, param.algo.library, tree.hash_size,
+				tree.levels[level] + node * tree.hash_size, children, num_children * tree.hash_size);
+}
+
+void digest_tree_add(const void *hash)
+{
+	memcpy(tree.stage + tree.staged * tree.hash_size, hash, tree.hash_size);
+
+	if (++tree.staged == tree.fanout[0])
+	{
+		tree_hash_node(0, tree.nodes++, tree.stage, tree.staged);
+		tree.staged = 0;
+	}
+}
+
+/* adds the first num_blocks block hashes already stored in the digest file to the tree */
+void digest_tree_rebuild(size_t num_blocks)
+{
+	if (BIT_SET(flag.dont_write, 0))
+		return;
+
+	size_t size = tree.fanout[0] * tree.hash_size;
+	char *buf = malloc(size);
+
+	if (buf == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for the digest tree\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	for (size_t block = 0; block < num_blocks; block += tree.fanout[0])
+	{
+		size_t num_hashes = MIN(tree.fanout[0], num_blocks - block);
+
+		if (pread(digest.fd, buf, num_hashes * tree.hash_size, HEADER_SIZE + block * tree.hash_size) != (ssize_t)(num_hashes * tree.hash_size))
+		{
+			fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name, digest.path, strerror(errno));
+			free(buf);
+			cleanup(EXIT_FAILURE);
+		}
+
+		for (size_t i = 0; i < num_hashes; i++)
+			digest_tree_add((const void *)(buf + i * tree.hash_size));
+	}
+
+	free(buf);
+}
+
+void digest_tree_write(void)
+{
+	if (tree.staged > 0)
+	{
+		tree_hash_node(0, tree.nodes++, tree.stage, tree.staged);
+		tree.staged = 0;
+	}
+
+	for (int i = 1; i < TREE_LEVELS; i++)
+		for (size_t node = 0; node < tree.count[i + 1]; node++)
+		{
+			size_t first = node * tree.fanout[i];
+			tree_hash_node(i, node, tree.levels[i - 1] + first * tree.hash_size, MIN(tree.fanout[i], tree.count[i] - first));
+		}
+
+	if (BIT_SET(flag.dont_write, 0))
+		return;
+
+	off_t off = HEADER_SIZE + tree.count[0] * tree.hash_size;
+
+	for (int i = 0; i < TREE_LEVELS; i++)
+	{
+		size_t size = tree.count[i + 1] * tree.hash_size;
+		ssize_t wbytes;
+
+		if (IS_MODE(digest.open_mode, PIPE))
+			wbytes = write(digest.fd, tree.levels[i], size);
+		else
+			wbytes = pwrite(digest.fd, tree.levels[i], size, off);
+
+		if (wbytes < 0)
+		{
+			fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name,
+					IS_MODE(digest.open_mode, PIPE) ? "stdout" : digest.path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		off += size;
+	}
+}
+
+void digest_tree_info(void)
+{
+	size_t fanout[TREE_LEVELS], count[TREE_LEVELS + 1];
+	int hash_size = 0;
+
+	for (int i = 0; algos[i].value != 0; i++)
+		if ((int)(digest_header.hash_type & ~(DIGEST_TREE | DIGEST_COARSE)) == algos[i].value)
+			hash_size = algos[i].size;
+
+	if (hash_size == 0)
+		return;
+
+	digest_tree_layout(digest_header.total_blocks, digest_header.block_size, fanout, count);
+
+	size_t size = HEADER_SIZE + count[0] * hash_size + digest_tree_size(count[0], digest_header.block_size, hash_size);
+
+	for (int i = 0; i < TREE_LEVELS; i++)
+		fprintf(flag.prst, "Tree level %d: %zu nodes over %s\n", i + 1, count[i + 1], format_units(tree_spans[i], false));
+
+	size_t file_size = size + (digest_header.hash_type & DIGEST_COARSE ? coarse_size(digest_header.data_size, hash_size) : 0);
+
+	if ((size_t)digest.data_size != file_size)
+		fprintf(stderr, "%s: digest tree of '%s' is incomplete, expected %s\n", process_name, digest.path, format_units(file_size, true));
+	else if (count[TREE_LEVELS] == 1)
+	{
+		unsigned char top[64];
+
+		if (pread(digest.fd, top, hash_size, size - hash_size) == hash_size)
+		{
+			fprintf(flag.prst, "Top hash: ");
+
+			for (int i = 0; i < hash_size; i++)
+				fprintf(flag.prst, "%02x", top[i]);
+
+			fprintf(flag.prst, "\n");
+		}
+	}
+}
+
+void digest_tree_free(void)
+{
+	if (tree.stage != NULL)
+		free(tree.stage);
+
+	for (int i = 0; i < TREE_LEVELS; i++)
+		if (tree.levels[i] != NULL)
+			free(tree.levels[i]);
+
+	memset(&tree, 0, sizeof(tree));
+}
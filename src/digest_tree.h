@@ -0,0 +1,33 @@
+/*
+ ./src/digest_tree.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef DIGEST_TREE_H
+#define DIGEST_TREE_H
+
+#define TREE_LEVELS (3)
+
+void digest_tree_layout(size_t num_blocks, size_t block_size, size_t fanout[], size_t count[]);
+size_t digest_tree_size(size_t num_blocks, size_t block_size, int hash_size);
+void digest_tree_init(void);
+void digest_tree_add(const void *hash);
+void digest_tree_rebuild(size_t num_blocks);
+void digest_tree_write(void);
+void digest_tree_info(void);
+void digest_tree_free(void);
+
+#endif
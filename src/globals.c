@@ -17,13 +17,28 @@
 */
 
 #include "globals.h"
+#include "hash_pool.h"
+#include "uring.h"
+#include "readahead.h"
+#include "sparse.h"
+#include "digest_tree.h"
+#include "compress.h"
+#include "compare.h"
+#include "jobs.h"
+#include "throttle.h"
+#include "remote.h"
+#include "coarse.h"
+#include "changed_ranges.h"
+#include "sectors.h"
+#include "stats.h"
+#include "copy_range.h"
 
 int PAGE_SIZE = 4096;
 struct dev src, dst, digest, delta = {NULL, -1, {}, 0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL, NONE};
 struct bsf_header digest_header, delta_header = {"", "", 0, 0, 0, NONE};
 struct oper oper = {0, 0, 0, 0, NULL, NULL};
-struct flag flag = {BLOCKSYNC, 0, 0, 0, 0, 0, 0, 0, NULL};
-struct prog prog = {0, 0, 0, 0, false, false, false, false, false, false, false, false};
+struct flag flag = {BLOCKSYNC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL};
+struct prog prog = {0, 0, false, false, false, false, false, false, false, false};
 
 char *process_name = PROGRAM_NAME;
 
@@ -78,7 +93,7 @@ const struct symbol_value_desc algos[] =
 
 		{"", 0, 0, 0, ""}};
 
-struct param param = {NULL, D_BLOCK_SIZE, D_BUFFER_SIZE, 0, NULL, 0, 0, 1, "", false, NULL, algos[D_ALGO]};
+struct param param = {NULL, D_BLOCK_SIZE, D_BUFFER_SIZE, 0, NULL, 0, 0, 1, "", false, 1, D_QUEUE_DEPTH, 0, 1, NULL, 0, 0, NULL, NULL, NULL, 0, {NULL, NULL}, NULL, 0, CODEC_NONE, 0, DELTA_BLOCKS, NULL, algos[D_ALGO]};
 
 void get_ptr(struct dev *dev)
 {
@@ -89,7 +104,49 @@ void get_ptr(struct dev *dev)
 		dev->ptr_w = dev->buf_data + (dev->rel_off);
 }
 
-void map_buffer(struct dev *dev)
+void *alloc_buffer(size_t size)
+{
+	void *buf = NULL;
+
+	if (flag.direct_io == 0)
+		return malloc(size);
+
+	if (posix_memalign(&buf, PAGE_SIZE, size) != 0)
+		return NULL;
+
+	return buf;
+}
+
+size_t dio_size(struct dev *dev, size_t size)
+{
+	if (dev->dio_align == 0)
+		return size;
+
+	return ((size + dev->dio_align - 1) / dev->dio_align) * dev->dio_align;
+}
+
+/* checks the buffer at ptr against the memory alignment and size and off against the offset alignment of O_DIRECT on dev */
+bool dio_aligned(struct dev *dev, const void *ptr, size_t size, off_t off)
+{
+	if (dev->dio_align == 0)
+		return true;
+
+	return ((uintptr_t)ptr % dev->dio_mem_align) == 0 && (size % dev->dio_align) == 0 && (off % dev->dio_align) == 0;
+}
+
+ssize_t dev_pwrite(struct dev *dev, const void *ptr, size_t size, off_t off)
+{
+	if (dio_aligned(dev, ptr, size, off))
+		return pwrite(dev->fd, ptr, size, off);
+
+	/* O_DIRECT needs aligned memory, size and offset, so the unaligned tail block goes through the page cache */
+	return pwrite(dev->tail_fd, ptr, size, off);
+}
+
+/* set while the reads of map_buffers() are queued, they are waited for at once */
+static bool map_defer = false;
+
+static void map_buffer_load(struct dev *dev)
 {
 	if (dev->buf_data != NULL && IS_MODE(dev->open_mode, MMAP))
 		munmap(dev->buf_data, dev->buf_size);
@@ -117,19 +174,49 @@ void map_buffer(struct dev *dev)
 		}
 	}
 
-	if (IS_MODE(dev->open_mode, DIRECT))
+	if (IS_MODE(dev->open_mode, DIRECT) || IS_MODE(dev->open_mode, PIPE_W))
 		dev->buf_size = (dev->data_size - dev->abs_off) >= dev->max_buf_size ? dev->max_buf_size : (dev->data_size - dev->abs_off);
 
-	if (IS_MODE(dev->open_mode, DIRECT_R))
+	/* pending io_uring writes may still point into any of the buffers */
+	uring_wait_writes();
+
+	/* the read-ahead thread paces its reads itself */
+	if (IS_MODE(dev->open_mode, READ) && dev->ra == NULL)
+		throttle_io(dev->buf_size);
+
+	if (dev->codec != CODEC_NONE && IS_MODE(dev->open_mode, READ))
+		decompress_buffer(dev);
+	else if (IS_MODE(dev->open_mode, DIRECT_R) && dev->ra != NULL)
+		readahead_next(dev);
+	else if (IS_MODE(dev->open_mode, DIRECT_R) && sparse_hole(dev, dev->abs_off, dev->buf_size))
+		sparse_read(dev, dev->buf_data, dev->abs_off, dev->buf_size);
+	else if (IS_MODE(dev->open_mode, URING_R))
 	{
-		if (pread(dev->fd, dev->buf_data, dev->buf_size, dev->abs_off) < 0)
+		uring_read(dev, dev->buf_data, dio_size(dev, dev->buf_size), dev->abs_off);
+
+		if (!map_defer)
+			uring_wait();
+	}
+	else if (IS_MODE(dev->open_mode, DIRECT_R))
+	{
+		struct stats_clock clk;
+
+		stats_begin(&clk);
+
+		ssize_t rbytes = pread(dev->fd, dev->buf_data, dio_size(dev, dev->buf_size), dev->abs_off);
+
+		if (rbytes < 0)
 		{
 			fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name, dev->path, strerror(errno));
 			cleanup(EXIT_FAILURE);
 		}
+
+		stats_io(dev, STATS_READ, rbytes, &clk);
 	}
 
-	if (IS_MODE(dev->open_mode, PIPE_R))
+	else if (IS_MODE(dev->open_mode, PIPE_R) && dev->ra != NULL)
+		readahead_next(dev);
+	else if (IS_MODE(dev->open_mode, PIPE_R))
 	{
 		dev->buf_size = (dev->data_size - abs_off) >= dev->max_buf_size ? dev->max_buf_size : (dev->data_size - abs_off);
 
@@ -138,6 +225,9 @@ void map_buffer(struct dev *dev)
 
 		while (tbytes < dev->buf_size)
 		{
+			struct stats_clock clk;
+
+			stats_begin(&clk);
 			rbytes = read(dev->fd, (dev->buf_data + tbytes), (dev->buf_size - tbytes));
 
 			if (rbytes < 0)
@@ -146,6 +236,8 @@ void map_buffer(struct dev *dev)
 				cleanup(EXIT_FAILURE);
 			}
 
+			stats_io(dev, STATS_READ, rbytes, &clk);
+
 			if (rbytes == 0)
 			{
 				dev->buf_size = tbytes;
@@ -161,6 +253,39 @@ void map_buffer(struct dev *dev)
 	dev->buf_off = abs_off + dev->buf_size;
 }
 
+void map_buffer(struct dev *dev)
+{
+	struct stats_clock clk;
+	bool read = IS_MODE(dev->open_mode, READ);
+
+	stats_begin(&clk);
+	map_buffer_load(dev);
+	stats_end(&clk, STATS_READ, read ? dev->buf_size : 0);
+}
+
+/* loads the src and dst buffers, with io_uring the reads of both devices are in flight together */
+void map_buffers(struct dev *a, struct dev *b)
+{
+	struct stats_clock clk;
+	size_t bytes = 0;
+
+	stats_begin(&clk);
+
+	map_defer = true;
+	map_buffer_load(a);
+	map_buffer_load(b);
+	map_defer = false;
+	uring_wait();
+
+	if (IS_MODE(a->open_mode, READ))
+		bytes += a->buf_size;
+
+	if (IS_MODE(b->open_mode, READ))
+		bytes += b->buf_size;
+
+	stats_end(&clk, STATS_READ, bytes);
+}
+
 bool check_buffer_reload(struct dev *dev)
 {
 	bool dev_reload = false;
@@ -177,16 +302,87 @@ bool check_buffer_reload(struct dev *dev)
 	return dev_reload;
 }
 
+/* number of blocks from the current one on that are processed without reloading the buffer */
+size_t dev_loaded_blocks(struct dev *dev)
+{
+	size_t num_blocks = 1;
+	off_t abs_off = dev->abs_off + dev->block_size;
+	off_t rel_off = dev->rel_off + dev->block_size;
+
+	while ((size_t)abs_off < dev->data_size)
+	{
+		size_t block_size = MIN(dev->block_size, dev->data_size - abs_off);
+
+		if (IS_MODE(dev->open_mode, MMAP) && (size_t)rel_off + block_size >= dev->buf_size)
+			break;
+
+		if (!IS_MODE(dev->open_mode, MMAP) && abs_off >= dev->buf_off)
+			break;
+
+		num_blocks++;
+		abs_off += dev->block_size;
+		rel_off += dev->block_size;
+	}
+
+	return num_blocks;
+}
+
 void sync_data(struct dev *dev)
 {
 	if (flag.write_sync == 1 && dev->buf_data != NULL)
 	{
+		struct stats_clock clk;
+
+		stats_begin(&clk);
+
+		if (IS_MODE(dev->open_mode, URING_W))
+			uring_wait();
+
 		if (IS_MODE(dev->open_mode, DIRECT_W))
+		{
+			readahead_drain();
 			fsync(dev->fd);
+		}
 
 		if (IS_MODE(dev->open_mode, MMAP_W))
 			msync(dev->buf_data, dev->buf_size, MS_SYNC);
+
+		stats_end(&clk, STATS_SYNC, 0);
+		stats_io(dev, STATS_SYNC, 0, &clk);
+	}
+}
+
+static void blocksync_dev_wri_run(const char *ptr, size_t size, off_t off)
+{
+	struct stats_clock clk;
+
+	stats_begin(&clk);
+
+	/* runs between files on one filesystem are cloned or copied by the kernel */
+	if (!copy_range_write(size, off))
+	{
+		if (IS_MODE(dst.open_mode, URING_W) && dio_aligned(&dst, ptr, size, off))
+		{
+			/* io_uring records its requests when they complete */
+			uring_write(&dst, ptr, size, off);
+			return;
+		}
+		else if (readahead_writer())
+		{
+			/* the writer thread records the call */
+			readahead_write(&dst, ptr, size, off);
+			return;
+		}
+		else if (dev_pwrite(&dst, ptr, size, off) < 0)
+		{
+			fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, dst.path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
 	}
+	else if (readahead_writer())
+		throttle_io(size);
+
+	stats_io(&dst, STATS_WRITE, size, &clk);
 }
 
 void blocksync_dev_wri_flush(size_t flush)
@@ -196,25 +392,28 @@ void blocksync_dev_wri_flush(size_t flush)
 		if (!BIT_SET(flag.dont_write, 1))
 		{
 			off_t wri_buf_off = oper.dev_wri_buf_size + flush;
+			off_t abs_buf_off = dst.abs_off - wri_buf_off;
+			const char *ptr = src.buf_data + (src.rel_off - wri_buf_off);
+			char *ptr_dst = dst.buf_data + (dst.rel_off - wri_buf_off);
+			const char *old = sectors_old(ptr_dst, oper.dev_wri_buf_size, abs_buf_off);
+			struct stats_clock clk;
 
-			if (IS_MODE(dst.open_mode, MMAP_W))
-			{
-				void *ptr_dst = dst.buf_data + (dst.rel_off - wri_buf_off);
-				const void *ptr_src = src.buf_data + (src.rel_off - wri_buf_off);
-				memcpy(ptr_dst, ptr_src, oper.dev_wri_buf_size);
-			}
+			if (!readahead_writer())
+				throttle_io(oper.dev_wri_buf_size);
 
-			if (IS_MODE(dst.open_mode, DIRECT_W))
+			stats_begin(&clk);
+
+			/* only the sectors which differ from the old target data are written */
+			for (size_t pos = 0, size; (size = sectors_dirty_run(ptr, old, abs_buf_off, oper.dev_wri_buf_size, &pos)) > 0; pos += size)
 			{
-				off_t rel_buf_off = src.rel_off - wri_buf_off;
-				off_t abs_buf_off = dst.abs_off - wri_buf_off;
-				const void *ptr = src.buf_data + rel_buf_off;
-				if (pwrite(dst.fd, ptr, oper.dev_wri_buf_size, abs_buf_off) < 0)
-				{
-					fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, dst.path, strerror(errno));
-					cleanup(EXIT_FAILURE);
-				}
+				if (IS_MODE(dst.open_mode, MMAP_W))
+					memcpy(ptr_dst + pos, ptr + pos, size);
+
+				if (IS_MODE(dst.open_mode, DIRECT_W))
+					blocksync_dev_wri_run(ptr + pos, size, abs_buf_off + pos);
 			}
+
+			stats_end(&clk, STATS_WRITE, oper.dev_wri_buf_size);
 		}
 
 		oper.dev_wri_buf_size = 0;
@@ -228,6 +427,9 @@ void digest_wri_flush(size_t flush)
 		if (!BIT_SET(flag.dont_write, 0))
 		{
 			off_t wri_buf_off = oper.digest_wri_buf_size + flush;
+			struct stats_clock clk;
+
+			stats_begin(&clk);
 
 			if (IS_MODE(digest.open_mode, MMAP_W))
 			{
@@ -241,11 +443,15 @@ void digest_wri_flush(size_t flush)
 				off_t rel_buf_off = digest.rel_off - wri_buf_off;
 				off_t abs_buf_off = digest.abs_off - wri_buf_off;
 				const void *ptr = oper.hash_buf + (rel_buf_off - digest.mov_off);
-				if (pwrite(digest.fd, ptr, oper.digest_wri_buf_size, abs_buf_off) < 0)
+				if (IS_MODE(digest.open_mode, URING_W))
+					uring_write(&digest, ptr, oper.digest_wri_buf_size, abs_buf_off);
+				else if (pwrite(digest.fd, ptr, oper.digest_wri_buf_size, abs_buf_off) < 0)
 				{
 					fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, digest.path, strerror(errno));
 					cleanup(EXIT_FAILURE);
 				}
+				else
+					stats_io(&digest, STATS_WRITE, oper.digest_wri_buf_size, &clk);
 			}
 
 			if (IS_MODE(digest.open_mode, PIPE_W))
@@ -257,7 +463,11 @@ void digest_wri_flush(size_t flush)
 					fprintf(stderr, "%s: error while writing to stdout: %s\n", process_name, strerror(errno));
 					cleanup(EXIT_FAILURE);
 				}
+
+				stats_io(&digest, STATS_WRITE, oper.digest_wri_buf_size, &clk);
 			}
+
+			stats_end(&clk, STATS_WRITE, oper.digest_wri_buf_size);
 		}
 
 		oper.digest_wri_buf_size = 0;
@@ -293,6 +503,9 @@ void freedev(struct dev *dev)
 	if (IS_MODE(dev->open_mode, PIPE) && dev->buf_data != NULL)
 		free(dev->buf_data);
 
+	if (dev->dio_align > 0)
+		close(dev->tail_fd);
+
 	if (dev->fd >= 0)
 		close(dev->fd);
 }
@@ -317,9 +530,17 @@ void hash_init(int algo, int lib)
 					process_name);
 			cleanup(EXIT_FAILURE);
 		}
+	}
+
+	hash_ctx_init(&oper.hash_ctx, algo, lib);
+}
 
+void hash_ctx_init(struct hash_ctx *ctx, int algo, int lib)
+{
+	if (lib == LIBGCRYPT)
+	{
 		gcry_error_t err;
-		err = gcry_md_open(&oper.gcrypt_state, algo, 0);
+		err = gcry_md_open(&ctx->gcrypt_state, algo, 0);
 
 		if (err)
 		{
@@ -332,17 +553,17 @@ void hash_init(int algo, int lib)
 		switch (algo)
 		{
 		case XXHASH_MD_XXH32:
-			oper.xxhash_state.xxh32 = XXH32_createState();
+			ctx->xxhash_state.xxh32 = XXH32_createState();
 			break;
 
 		case XXHASH_MD_XXH64:
-			oper.xxhash_state.xxh64 = XXH64_createState();
+			ctx->xxhash_state.xxh64 = XXH64_createState();
 			break;
 
 		case XXHASH_MD_XXH3LOW:
 		case XXHASH_MD_XXH3:
 		case XXHASH_MD_XXH128:
-			oper.xxhash_state.xxh3 = XXH3_createState();
+			ctx->xxhash_state.xxh3 = XXH3_createState();
 			break;
 		}
 #endif
@@ -358,12 +579,17 @@ void *hash_alloc(size_t size, int lib)
 }
 
 void hash_buffer(int algo, int lib, int hash_size, void *digest, const void *buffer, size_t size)
+{
+	hash_ctx_buffer(&oper.hash_ctx, algo, lib, hash_size, digest, buffer, size);
+}
+
+void hash_ctx_buffer(struct hash_ctx *ctx, int algo, int lib, int hash_size, void *digest, const void *buffer, size_t size)
 {
 	if (lib == LIBGCRYPT)
 	{
-		gcry_md_write(oper.gcrypt_state, buffer, size);
-		memcpy(digest, gcry_md_read(oper.gcrypt_state, algo), hash_size);
-		gcry_md_reset(oper.gcrypt_state);
+		gcry_md_write(ctx->gcrypt_state, buffer, size);
+		memcpy(digest, gcry_md_read(ctx->gcrypt_state, algo), hash_size);
+		gcry_md_reset(ctx->gcrypt_state);
 	}
 
 #ifdef HAVE_XXHASH
@@ -371,75 +597,142 @@ void hash_buffer(int algo, int lib, int hash_size, void *digest, const void *buf
 		switch (algo)
 		{
 		case XXHASH_MD_XXH32:
-			XXH32_reset(oper.xxhash_state.xxh32, 0);
-			XXH32_update(oper.xxhash_state.xxh32, buffer, size);
-			XXH32_canonicalFromHash(digest, XXH32_digest(oper.xxhash_state.xxh32));
+			XXH32_reset(ctx->xxhash_state.xxh32, 0);
+			XXH32_update(ctx->xxhash_state.xxh32, buffer, size);
+			XXH32_canonicalFromHash(digest, XXH32_digest(ctx->xxhash_state.xxh32));
 			break;
 
 		case XXHASH_MD_XXH64:
-			XXH64_reset(oper.xxhash_state.xxh64, 0);
-			XXH64_update(oper.xxhash_state.xxh64, buffer, size);
-			XXH64_canonicalFromHash(digest, XXH64_digest(oper.xxhash_state.xxh64));
+			XXH64_reset(ctx->xxhash_state.xxh64, 0);
+			XXH64_update(ctx->xxhash_state.xxh64, buffer, size);
+			XXH64_canonicalFromHash(digest, XXH64_digest(ctx->xxhash_state.xxh64));
 			break;
 
 		case XXHASH_MD_XXH3LOW:
 		case XXHASH_MD_XXH3:
-			XXH3_64bits_reset(oper.xxhash_state.xxh3);
-			XXH3_64bits_update(oper.xxhash_state.xxh3, buffer, size);
+			XXH3_64bits_reset(ctx->xxhash_state.xxh3);
+			XXH3_64bits_update(ctx->xxhash_state.xxh3, buffer, size);
 			if (algo == XXHASH_MD_XXH3LOW)
-				XXH32_canonicalFromHash(digest, (uint32_t)(XXH3_64bits_digest(oper.xxhash_state.xxh3) & 0xFFFFFFFF));
+				XXH32_canonicalFromHash(digest, (uint32_t)(XXH3_64bits_digest(ctx->xxhash_state.xxh3) & 0xFFFFFFFF));
 			else
-				XXH64_canonicalFromHash(digest, XXH3_64bits_digest(oper.xxhash_state.xxh3));
+				XXH64_canonicalFromHash(digest, XXH3_64bits_digest(ctx->xxhash_state.xxh3));
 			break;
 
 		case XXHASH_MD_XXH128:
-			XXH3_128bits_reset(oper.xxhash_state.xxh3);
-			XXH3_128bits_update(oper.xxhash_state.xxh3, buffer, size);
-			XXH128_canonicalFromHash(digest, XXH3_128bits_digest(oper.xxhash_state.xxh3));
+			XXH3_128bits_reset(ctx->xxhash_state.xxh3);
+			XXH3_128bits_update(ctx->xxhash_state.xxh3, buffer, size);
+			XXH128_canonicalFromHash(digest, XXH3_128bits_digest(ctx->xxhash_state.xxh3));
 			break;
 		}
 #endif
 }
 
-void hash_free(int algo, int lib, void *buf)
+void hash_blocks(int algo, int lib, int hash_size, void *digests, const void *buffer, size_t block_size, size_t size)
 {
-	if (buf == NULL)
-		return;
+	hash_ctx_blocks(&oper.hash_ctx, algo, lib, hash_size, digests, buffer, block_size, size);
+}
 
-	if (lib == LIBGCRYPT)
+/* hashes every block of the buffer into consecutive digests, the last block may be shorter */
+void hash_ctx_blocks(struct hash_ctx *ctx, int algo, int lib, int hash_size, void *digests, const void *buffer, size_t block_size, size_t size)
+{
+	char *digest = (char *)digests;
+	const char *block = (const char *)buffer;
+	const char *end = block + size;
+
+#ifdef HAVE_XXHASH
+	/* one-shot calls skip the reset and finalization of a streaming state for every block */
+	if (lib == LIBXXHASH)
 	{
-		gcry_md_close(oper.gcrypt_state);
-		gcry_free(buf);
+		for (; block < end; block += block_size, digest += hash_size)
+		{
+			size_t len = MIN(block_size, (size_t)(end - block));
+
+			switch (algo)
+			{
+			case XXHASH_MD_XXH32:
+				XXH32_canonicalFromHash((void *)digest, XXH32(block, len, 0));
+				break;
+
+			case XXHASH_MD_XXH64:
+				XXH64_canonicalFromHash((void *)digest, XXH64(block, len, 0));
+				break;
+
+			case XXHASH_MD_XXH3LOW:
+				XXH32_canonicalFromHash((void *)digest, (uint32_t)(XXH3_64bits(block, len) & 0xFFFFFFFF));
+				break;
+
+			case XXHASH_MD_XXH3:
+				XXH64_canonicalFromHash((void *)digest, XXH3_64bits(block, len));
+				break;
+
+			case XXHASH_MD_XXH128:
+				XXH128_canonicalFromHash((void *)digest, XXH3_128bits(block, len));
+				break;
+			}
+		}
+
+		return;
 	}
+#endif
+
+	for (; block < end; block += block_size, digest += hash_size)
+		hash_ctx_buffer(ctx, algo, lib, hash_size, (void *)digest, (const void *)block, MIN(block_size, (size_t)(end - block)));
+}
+
+void hash_ctx_free(struct hash_ctx *ctx, int algo, int lib)
+{
+	if (lib == LIBGCRYPT)
+		gcry_md_close(ctx->gcrypt_state);
 #ifdef HAVE_XXHASH
 	else if (lib == LIBXXHASH)
-	{
 		switch (algo)
 		{
 		case XXHASH_MD_XXH32:
-			XXH32_freeState(oper.xxhash_state.xxh32);
+			XXH32_freeState(ctx->xxhash_state.xxh32);
 			break;
 
 		case XXHASH_MD_XXH64:
-			XXH64_freeState(oper.xxhash_state.xxh64);
+			XXH64_freeState(ctx->xxhash_state.xxh64);
 			break;
 
 		case XXHASH_MD_XXH3LOW:
 		case XXHASH_MD_XXH3:
 		case XXHASH_MD_XXH128:
-			XXH3_freeState(oper.xxhash_state.xxh3);
+			XXH3_freeState(ctx->xxhash_state.xxh3);
 			break;
 		}
+#endif
+}
 
+void hash_free(int algo, int lib, void *buf)
+{
+	if (buf == NULL)
+		return;
+
+	hash_ctx_free(&oper.hash_ctx, algo, lib);
+
+	if (lib == LIBGCRYPT)
+		gcry_free(buf);
+	else
 		free(buf);
-	}
-#endif
 }
 
 void makedelta_wri_flush_buf()
 {
 	if (oper.delta_wri_buf_size > 0)
 	{
+		struct stats_clock clk;
+
+		stats_begin(&clk);
+
+		if (delta.codec != CODEC_NONE)
+		{
+			compress_submit(&delta);
+			stats_end(&clk, STATS_WRITE, oper.delta_wri_buf_size);
+			oper.delta_wri_buf_size = 0;
+			return;
+		}
+
 		if (IS_MODE(delta.open_mode, MMAP_W))
 		{
 			void *ptr_delta = delta.buf_data + (delta.rel_off - (off_t)oper.delta_wri_buf_size);
@@ -451,11 +744,18 @@ void makedelta_wri_flush_buf()
 		{
 			off_t abs_buf_off = delta.abs_off - oper.delta_wri_buf_size;
 
-			if (pwrite(delta.fd, (const void *)oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off) < 0)
+			if (IS_MODE(delta.open_mode, URING_W))
+			{
+				uring_write(&delta, (const void *)oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off);
+				uring_wait();
+			}
+			else if (pwrite(delta.fd, (const void *)oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off) < 0)
 			{
 				fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, delta.path, strerror(errno));
 				cleanup(EXIT_FAILURE);
 			}
+			else
+				stats_io(&delta, STATS_WRITE, oper.delta_wri_buf_size, &clk);
 		}
 
 		if (IS_MODE(delta.open_mode, PIPE_W))
@@ -465,8 +765,11 @@ void makedelta_wri_flush_buf()
 				fprintf(stderr, "%s: error while writing to stdout: %s\n", process_name, strerror(errno));
 				cleanup(EXIT_FAILURE);
 			}
+
+			stats_io(&delta, STATS_WRITE, oper.delta_wri_buf_size, &clk);
 		}
 
+		stats_end(&clk, STATS_WRITE, oper.delta_wri_buf_size);
 		oper.delta_wri_buf_size = 0;
 	}
 }
@@ -479,6 +782,10 @@ void applydelta_wri_flush_buf(size_t ahead)
 		{
 
 			off_t wri_buf_off = oper.delta_wri_buf_size - ahead;
+			struct stats_clock clk;
+
+			throttle_io(oper.delta_wri_buf_size);
+			stats_begin(&clk);
 
 			if (IS_MODE(dst.open_mode, MMAP_W))
 			{
@@ -491,18 +798,78 @@ void applydelta_wri_flush_buf(size_t ahead)
 			{
 				off_t abs_buf_off = dst.abs_off - wri_buf_off;
 
-				if (pwrite(dst.fd, (const void *)oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off) < 0)
+				if (IS_MODE(dst.open_mode, URING_W) && dio_aligned(&dst, oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off))
+				{
+					uring_write(&dst, (const void *)oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off);
+					uring_wait();
+				}
+				else if (dev_pwrite(&dst, (const void *)oper.delta_buf, oper.delta_wri_buf_size, abs_buf_off) < 0)
 				{
 					fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, dst.path, strerror(errno));
 					cleanup(EXIT_FAILURE);
 				}
+				else
+					stats_io(&dst, STATS_WRITE, oper.delta_wri_buf_size, &clk);
 			}
+
+			stats_end(&clk, STATS_WRITE, oper.delta_wri_buf_size);
 		}
 
 		oper.delta_wri_buf_size = 0;
 	}
 }
 
+void applydelta_wri_extent(const void *ptr, size_t size, off_t off)
+{
+	struct stats_clock clk;
+	size_t bytes = size;
+
+	if (BIT_SET(flag.dont_write, 0))
+		return;
+
+	throttle_io(size);
+	stats_begin(&clk);
+
+	if (IS_MODE(dst.open_mode, MMAP_W))
+	{
+		while (size > 0)
+		{
+			off_t map_off = dst.buf_off - (off_t)dst.buf_size;
+
+			if (dst.buf_data == NULL || off < map_off || off >= dst.buf_off)
+			{
+				sync_data(&dst);
+				dst.abs_off = off;
+				map_buffer(&dst);
+				map_off = dst.buf_off - (off_t)dst.buf_size;
+			}
+
+			size_t wri_size = MIN(size, (size_t)(dst.buf_off - off));
+			memcpy(dst.buf_data + (off - map_off), ptr, wri_size);
+
+			ptr = (const char *)ptr + wri_size;
+			size -= wri_size;
+			off += wri_size;
+		}
+	}
+
+	if (IS_MODE(dst.open_mode, DIRECT_W))
+	{
+		/* the payload stays in the delta buffer, map_buffer() waits for it before the next read */
+		if (IS_MODE(dst.open_mode, URING_W) && dio_aligned(&dst, ptr, size, off))
+			uring_write(&dst, ptr, size, off);
+		else if (dev_pwrite(&dst, ptr, size, off) < 0)
+		{
+			fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, dst.path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+		else
+			stats_io(&dst, STATS_WRITE, size, &clk);
+	}
+
+	stats_end(&clk, STATS_WRITE, bytes);
+}
+
 void oper_delta_buf_free()
 {
 	if (oper.delta_buf != NULL)
@@ -511,6 +878,20 @@ void oper_delta_buf_free()
 
 void cleanup(int result)
 {
+	hash_pool_free();
+	uring_free();
+	readahead_free();
+	sparse_free();
+	digest_tree_free();
+	codec_free();
+	compare_free();
+	jobs_free();
+	throttle_free();
+	remote_free();
+	coarse_free();
+	changed_ranges_free();
+	sectors_free();
+	stats_free();
 	freedev(&src);
 	freedev(&dst);
 	freedev(&digest);
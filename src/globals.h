@@ -31,6 +31,10 @@
 
 #include <config.h>
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -87,11 +91,23 @@ extern int PAGE_SIZE;
 
 #define D_BLOCK_SIZE (4 * 1024)			// 4KiB
 #define D_BUFFER_SIZE (2 * 1024 * 1024) // 2 MiB
+#define D_SECTOR_SIZE (4 * 1024)		// 4KiB
+#define MAX_THREADS (256)
+#define MAX_JOBS (256)
+#define CHECKPOINT_INTERVAL (30) // seconds between checkpoints of a resumable run
+#define D_QUEUE_DEPTH (16)
+#define MAX_QUEUE_DEPTH (4096)
+#define MAX_READ_AHEAD (64)
 #define HEADER_SIZE (512)
 
 #define MAGIC_NUMBER "!BSF#"
 #define MAGIC_DIGEST MAGIC_NUMBER "DIG"
 #define MAGIC_DELTA MAGIC_NUMBER "DELTA"
+#define MAGIC_DELTA2 MAGIC_NUMBER "DELTA2" // delta with codec and format fields
+#define MAGIC_REMOTE MAGIC_NUMBER "REMOTE"
+#define DIGEST_TREE (0x10000) // hash_type flag of a digest with parent levels
+#define DIGEST_COARSE (0x20000) // hash_type flag of a digest with hashes of whole COARSE_SIZE ranges
+#define COARSE_SIZE (1UL << 20)
 
 #define BIT_SET(v, p) ((v) & (1 << (p)))
 #define IS_MODE(v, p) (((v) & (p)) == (p))
@@ -125,7 +141,15 @@ extern struct dev
 		PIPE = 16,	  // 10000
 		PIPE_R = 17,  // 10001
 		PIPE_W = 18,  // 10010
+		URING = 32,	  // 100000
+		URING_R = 37, // 100101 (DIRECT_R with io_uring)
+		URING_W = 38, // 100110 (DIRECT_W with io_uring)
 	} open_mode;
+	size_t dio_align;
+	size_t dio_mem_align;
+	int tail_fd;
+	int codec;
+	struct readahead *ra;
 } src, dst, digest, delta;
 
 extern struct bsf_header
@@ -137,7 +161,16 @@ extern struct bsf_header
 	uint64_t total_blocks;
 	uint64_t timestamp;
 	uint64_t hash_type;
-	char padding[448];
+	uint64_t codec;
+	uint64_t format;
+	uint64_t resume_off;
+	uint64_t resume_delta;
+	uint64_t cache_mtime;
+	uint64_t cache_ctime;
+	uint64_t cache_ino;
+	uint64_t cache_size;
+	uint64_t cache_stamped;
+	char padding[376];
 } digest_header, delta_header;
 
 extern struct symbol_value_desc
@@ -151,14 +184,8 @@ extern struct symbol_value_desc
 
 extern const struct symbol_value_desc algos[];
 
-extern struct oper
+struct hash_ctx
 {
-	size_t num_block;
-	size_t dev_wri_buf_size;
-	size_t digest_wri_buf_size;
-	size_t delta_wri_buf_size;
-	char *hash_buf;
-	char *delta_buf;
 	gcry_md_hd_t gcrypt_state;
 #ifdef HAVE_XXHASH
 	union xxhash_state
@@ -168,6 +195,17 @@ extern struct oper
 		XXH3_state_t *xxh3;
 	} xxhash_state;
 #endif
+};
+
+extern struct oper
+{
+	size_t num_block;
+	size_t dev_wri_buf_size;
+	size_t digest_wri_buf_size;
+	size_t delta_wri_buf_size;
+	char *hash_buf;
+	char *delta_buf;
+	struct hash_ctx hash_ctx;
 } oper;
 
 extern struct param
@@ -182,10 +220,42 @@ extern struct param
 	int pro_fact;
 	char pro_form[20];
 	bool hash_use;
+	int threads;
+	int queue_depth;
+	int read_ahead;
+	int jobs;
+	char *jobs_file;
+	size_t max_rate;
+	int max_iops;
+	char *remote;
+	char *digest_cache;
+	char *changed_ranges;
+	size_t sector_size;
+	char *compare_digests[2];
+	char *stats;
+	int latency;
+	int codec;
+	int codec_level;
+	int delta_format;
 	const char *hash_algo;
 	struct symbol_value_desc algo;
 } param;
 
+enum codecs
+{
+	CODEC_NONE,
+	CODEC_ZSTD,
+	CODEC_LZ4,
+};
+
+enum delta_formats
+{
+	DELTA_BLOCKS,  // [offset][block] per changed block
+	DELTA_EXTENTS, // [offset][length][data] per run of changed blocks
+};
+
+#define DELTA_ZERO (1ULL << 63) // set in the length of an extent of zero blocks, which has no data
+
 enum oper_modes
 {
 	BLOCKSYNC,
@@ -195,6 +265,7 @@ enum oper_modes
 	MAKEDELTA,
 	APPLYDELTA,
 	MAKEDIGEST,
+	COMPAREDIGESTS,
 };
 
 extern struct flag
@@ -203,10 +274,18 @@ extern struct flag
 	int progress;
 	int force;
 	int mmap;
+	int io_uring;
+	int direct_io;
+	int sparse;
+	int digest_tree;
+	int digest_coarse;
+	int digest_cache_blkdev;
 	int write_sync;
 	int dont_write;
 	int silent;
 	int no_compare;
+	int resume;
+	int server;
 	FILE *prst;
 } flag;
 
@@ -214,27 +293,58 @@ extern struct prog
 {
 	size_t wri_bytes;
 	size_t wri_blocks;
-	double p_per, c_per;
 	bool p_dst_wri, c_dst_wri;
 	bool p_dst_mat, c_dst_mat;
 	bool p_dig_wri, c_dig_wri;
 	bool p_dig_mat, c_dig_mat;
 } prog;
 
+/* counters of the summary a --jobs worker leaves for the main process */
+struct job_stats
+{
+	size_t wri_blocks;
+	size_t wri_bytes;
+	size_t hole_bytes;
+	size_t zero_blocks;
+	size_t cloned_bytes;
+	size_t copied_bytes;
+	size_t sector_dirty_bytes;
+	size_t sector_same_bytes;
+	size_t coarse_hashed_bytes;
+	size_t coarse_clean_bytes;
+	size_t sent_bytes;
+	size_t recv_bytes;
+	double stall_reader;
+	double stall_compare;
+	double stall_writer;
+};
+
 void get_ptr(struct dev *dev);
+void *alloc_buffer(size_t size);
+size_t dio_size(struct dev *dev, size_t size);
+bool dio_aligned(struct dev *dev, const void *ptr, size_t size, off_t off);
+ssize_t dev_pwrite(struct dev *dev, const void *ptr, size_t size, off_t off);
 void map_buffer(struct dev *dev);
+void map_buffers(struct dev *a, struct dev *b);
 bool check_buffer_reload(struct dev *dev);
+size_t dev_loaded_blocks(struct dev *dev);
 void sync_data(struct dev *dev);
 void blocksync_dev_wri_flush(size_t flush);
 void digest_wri_flush(size_t flush);
 void dev_truncate(struct dev *dev);
 void freedev(struct dev *dev);
 void hash_init(int algo, int lib);
+void hash_ctx_init(struct hash_ctx *ctx, int algo, int lib);
 void *hash_alloc(size_t size, int lib);
 void hash_buffer(int algo, int lib, int hash_size, void *digest, const void *buffer, size_t size);
+void hash_ctx_buffer(struct hash_ctx *ctx, int algo, int lib, int hash_size, void *digest, const void *buffer, size_t size);
+void hash_blocks(int algo, int lib, int hash_size, void *digests, const void *buffer, size_t block_size, size_t size);
+void hash_ctx_blocks(struct hash_ctx *ctx, int algo, int lib, int hash_size, void *digests, const void *buffer, size_t block_size, size_t size);
+void hash_ctx_free(struct hash_ctx *ctx, int algo, int lib);
 void hash_free(int algo, int lib, void *buf);
 void makedelta_wri_flush_buf();
 void applydelta_wri_flush_buf(size_t);
+void applydelta_wri_extent(const void *ptr, size_t size, off_t off);
 void oper_delta_buf_free();
 void cleanup(int result);
 
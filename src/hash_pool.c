@@ -0,0 +1,246 @@
+/*
+ ./src/hash_pool.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "hash_pool.h"
+#include "sparse.h"
+#include "coarse.h"
+#include "stats.h"
+
+#include <pthread.h>
+
+/*
+ Hashes every block of a freshly loaded buffer at once with hash_ctx_blocks().
+ With more threads the buffer is split into equal block ranges, the main thread
+ takes the first range with oper.hash_ctx and each worker takes the next one
+ with its own context. Results land in pool.hashes, indexed by the block number
+ relative to the start of the buffer (dev->mov_off).
+*/
+
+static struct hash_pool
+{
+	int threads;
+	pthread_t *tids;
+	struct hash_ctx *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	unsigned long gen;
+	int pending;
+	bool quit;
+	const char *buf_data;
+	size_t buf_off;
+	size_t buf_size;
+	size_t block_size;
+	size_t num_hashes;
+	size_t max_hashes;
+	char *hashes;
+} pool = {1, NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, false, NULL, 0, 0, 0, 0, 0, NULL};
+
+static void hash_pool_blocks(struct hash_ctx *ctx, size_t first, size_t last)
+{
+	if (first >= last)
+		return;
+
+	size_t off = pool.buf_off + first * pool.block_size;
+	size_t size = MIN((last - first) * pool.block_size, pool.buf_size - off);
+
+	/* zero blocks of a sparse src get the precomputed hash in the main loop */
+	if (flag.sparse == 1)
+	{
+		for (size_t i = first; i < last; i++, off += pool.block_size)
+		{
+			size = MIN(pool.block_size, pool.buf_size - off);
+
+			if (!buffer_is_zero(pool.buf_data + off, size))
+				hash_ctx_blocks(ctx, param.algo.value, param.algo.library, param.algo.size,
+								(void *)(pool.hashes + i * param.algo.size), (const void *)(pool.buf_data + off), pool.block_size, size);
+		}
+
+		return;
+	}
+
+	hash_ctx_blocks(ctx, param.algo.value, param.algo.library, param.algo.size,
+					(void *)(pool.hashes + first * param.algo.size), (const void *)(pool.buf_data + off), pool.block_size, size);
+}
+
+static void hash_pool_range(struct hash_ctx *ctx, int part)
+{
+	size_t first = (pool.num_hashes * part) / pool.threads;
+	size_t last = (pool.num_hashes * (part + 1)) / pool.threads;
+
+	/* blocks of unchanged coarse ranges take their stored hashes */
+	while (first < last)
+	{
+		first += coarse_clean_run(first, last, pool.hashes);
+
+		size_t dirty = coarse_dirty_run(first, last);
+
+		hash_pool_blocks(ctx, first, first + dirty);
+		first += dirty;
+	}
+}
+
+static void *hash_pool_worker(void *arg)
+{
+	int part = (int)(intptr_t)arg;
+	unsigned long gen = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&pool.lock);
+
+		while (pool.gen == gen && !pool.quit)
+			pthread_cond_wait(&pool.work_cond, &pool.lock);
+
+		if (pool.quit)
+		{
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+
+		gen = pool.gen;
+		pthread_mutex_unlock(&pool.lock);
+
+		hash_pool_range(&pool.ctx[part], part);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done_cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	return NULL;
+}
+
+void hash_pool_init(int threads, size_t max_buf_size, size_t block_size)
+{
+	pool.threads = MAX(threads, 1);
+	pool.max_hashes = (max_buf_size / block_size) + 2;
+	pool.hashes = malloc(pool.max_hashes * param.algo.size);
+
+	if (pool.hashes == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for hashes\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (pool.threads < 2)
+		return;
+
+	pool.tids = calloc(pool.threads, sizeof(pthread_t));
+	pool.ctx = calloc(pool.threads, sizeof(struct hash_ctx));
+
+	if (pool.tids == NULL || pool.ctx == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for hashing threads\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	for (int i = 1; i < pool.threads; i++)
+	{
+		hash_ctx_init(&pool.ctx[i], param.algo.value, param.algo.library);
+
+		int err = pthread_create(&pool.tids[i], NULL, hash_pool_worker, (void *)(intptr_t)i);
+
+		if (err != 0)
+		{
+			fprintf(stderr, "%s: unable to create hashing thread: %s\n", process_name, strerror(err));
+			hash_ctx_free(&pool.ctx[i], param.algo.value, param.algo.library);
+			pool.threads = i;
+			cleanup(EXIT_FAILURE);
+		}
+	}
+}
+
+static void hash_pool_hash(struct dev *dev)
+{
+	coarse_run(dev);
+
+	pool.buf_data = dev->buf_data;
+	pool.buf_off = dev->mov_off;
+	pool.buf_size = dev->buf_size;
+	pool.block_size = param.block_size;
+	pool.num_hashes = 0;
+
+	if (pool.buf_size > pool.buf_off)
+		pool.num_hashes = MIN(pool.max_hashes, (pool.buf_size - pool.buf_off + pool.block_size - 1) / pool.block_size);
+
+	if (pool.threads < 2)
+	{
+		hash_pool_range(&oper.hash_ctx, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.pending = pool.threads - 1;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	hash_pool_range(&oper.hash_ctx, 0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done_cond, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void hash_pool_run(struct dev *dev)
+{
+	struct stats_clock clk;
+
+	if (pool.hashes == NULL)
+		return;
+
+	stats_begin(&clk);
+	hash_pool_hash(dev);
+	stats_end(&clk, STATS_HASH, dev->buf_size - dev->mov_off);
+}
+
+const void *hash_pool_get(struct dev *dev)
+{
+	size_t i = (dev->rel_off - dev->mov_off) / pool.block_size;
+
+	return (const void *)(pool.hashes + i * param.algo.size);
+}
+
+void hash_pool_free(void)
+{
+	free(pool.hashes);
+	pool.hashes = NULL;
+
+	if (pool.tids == NULL)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 1; i < pool.threads; i++)
+	{
+		pthread_join(pool.tids[i], NULL);
+		hash_ctx_free(&pool.ctx[i], param.algo.value, param.algo.library);
+	}
+
+	free(pool.tids);
+	free(pool.ctx);
+	pool.tids = NULL;
+	pool.threads = 1;
+}
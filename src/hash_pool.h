@@ -0,0 +1,27 @@
+/*
+ ./src/hash_pool.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef HASH_POOL_H
+#define HASH_POOL_H
+
+void hash_pool_init(int threads, size_t max_buf_size, size_t block_size);
+void hash_pool_run(struct dev *dev);
+const void *hash_pool_get(struct dev *dev);
+void hash_pool_free(void);
+
+#endif
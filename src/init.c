@@ -17,9 +17,52 @@
 */
 
 #include "globals.h"
+#include "uring.h"
+#include "digest_tree.h"
+#include "compress.h"
+#include "checkpoint.h"
+#include "coarse.h"
+
+#include <linux/fs.h> // BLKSSZGET
 
 void init_map_methods(void)
 {
+    if (flag.mmap == 1 && flag.io_uring == 1)
+    {
+        fprintf(stderr, "%s: options --mmap and --io-uring can't be used together\n", process_name);
+        cleanup(EXIT_FAILURE);
+    }
+
+    if (flag.io_uring == 1 && (param.queue_depth < 1 || param.queue_depth > MAX_QUEUE_DEPTH))
+    {
+        fprintf(stderr, "%s: the queue depth should be between 1 and %d\n", process_name, MAX_QUEUE_DEPTH);
+        cleanup(EXIT_FAILURE);
+    }
+
+    if (param.read_ahead != 0 && (param.read_ahead < 2 || param.read_ahead > MAX_READ_AHEAD))
+    {
+        fprintf(stderr, "%s: the number of read-ahead buffers should be between 2 and %d\n", process_name, MAX_READ_AHEAD);
+        cleanup(EXIT_FAILURE);
+    }
+
+    if (param.read_ahead > 0 && (flag.mmap == 1 || flag.io_uring == 1))
+    {
+        fprintf(stderr, "%s: option --read-ahead works only with direct read and write method\n", process_name);
+        cleanup(EXIT_FAILURE);
+    }
+
+    if (flag.direct_io == 1 && flag.mmap == 1)
+    {
+        fprintf(stderr, "%s: options --direct-io and --mmap can't be used together\n", process_name);
+        cleanup(EXIT_FAILURE);
+    }
+
+    if (flag.io_uring == 1 && !uring_init(param.queue_depth))
+    {
+        fprintf(flag.prst, "Warning: unable to set up io_uring (%s), uses direct read and write method\n", strerror(errno));
+        flag.io_uring = 0;
+    }
+
     if (flag.mmap == 1)
     {
         fprintf(flag.prst, "Uses mmap as an alternative read and write method\n");
@@ -36,6 +79,15 @@ void init_map_methods(void)
         delta.open_mode |= DIRECT;
     }
 
+    if (flag.io_uring == 1)
+    {
+        fprintf(flag.prst, "Uses io_uring with queue depth of %d requests\n", param.queue_depth);
+        src.open_mode |= URING;
+        dst.open_mode |= URING;
+        digest.open_mode |= URING;
+        delta.open_mode |= URING;
+    }
+
     if (flag.write_sync == 1)
         fprintf(flag.prst, "Syncs and flushes data to a disk device defined by the buffer size in bytes\n");
 }
@@ -72,6 +124,84 @@ void check_block_size(void)
     }
 }
 
+void check_threads(void)
+{
+    if (param.threads < 1 || param.threads > MAX_THREADS)
+    {
+        fprintf(stderr, "%s: the number of threads should be between 1 and %d\n", process_name, MAX_THREADS);
+        cleanup(EXIT_FAILURE);
+    }
+}
+
+void check_jobs(void)
+{
+    if (param.jobs < 1 || param.jobs > MAX_JOBS)
+    {
+        fprintf(stderr, "%s: the number of jobs should be between 1 and %d\n", process_name, MAX_JOBS);
+        cleanup(EXIT_FAILURE);
+    }
+
+    /* the jobs are forked processes, which can not share one ring */
+    if (param.jobs > 1 && flag.io_uring == 1)
+    {
+        fprintf(flag.prst, "Warning: io_uring is not used with --jobs\n");
+        flag.io_uring = 0;
+    }
+}
+
+void init_direct_io(struct dev *dev)
+{
+    int flags, sector_size = 0;
+
+    if (flag.direct_io == 0 || dev->fd < 0 || IS_MODE(dev->open_mode, PIPE))
+        return;
+
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+
+    /* the kernel reports the memory and offset alignment of O_DIRECT separately */
+    if (statx(dev->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0)
+    {
+        dev->dio_align = stx.stx_dio_offset_align;
+        dev->dio_mem_align = stx.stx_dio_mem_align;
+    }
+    else
+#endif
+    if (S_ISBLK(dev->stat.st_mode) && ioctl(dev->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+        dev->dio_align = dev->dio_mem_align = sector_size;
+    else
+        dev->dio_align = dev->dio_mem_align = MAX(dev->stat.st_blksize, 512);
+
+    if (param.block_size % dev->dio_align != 0)
+    {
+        fprintf(flag.prst, "Warning: block size is not a multiple of %zu bytes, '%s' uses the page cache\n",
+                dev->dio_align, dev->path);
+        dev->dio_align = 0;
+        return;
+    }
+
+    /* the unaligned tail is written through a second descriptor without O_DIRECT,
+       so the flags of the descriptor shared with the threads and io_uring never change */
+    if ((flags = fcntl(dev->fd, F_GETFL)) < 0 || (dev->tail_fd = open(dev->path, flags & O_ACCMODE)) < 0)
+    {
+        fprintf(flag.prst, "Warning: unable to use O_DIRECT on '%s' (%s), uses the page cache\n",
+                dev->path, strerror(errno));
+        dev->dio_align = 0;
+        return;
+    }
+
+    if (fcntl(dev->fd, F_SETFL, flags | O_DIRECT) < 0)
+    {
+        fprintf(flag.prst, "Warning: unable to use O_DIRECT on '%s' (%s), uses the page cache\n",
+                dev->path, strerror(errno));
+        close(dev->tail_fd);
+        dev->dio_align = 0;
+        return;
+    }
+
+    fprintf(flag.prst, "Uses O_DIRECT on '%s' aligned to %zu bytes\n", dev->path, dev->dio_align);
+}
+
 void init_src_device(void)
 {
     if (strcmp(src.path, "-") == 0) {
@@ -207,6 +337,25 @@ void init_dst_device(void)
         dst.open_mode ^= READ;
 }
 
+void init_remote_target(void)
+{
+    fprintf(flag.prst, "Target device: remote '%s'\n", param.remote);
+
+    if (digest.path != NULL)
+        fprintf(flag.prst, "Warning: digest file is not used with --remote\n");
+
+    if (param.jobs > 1)
+    {
+        fprintf(flag.prst, "Warning: --jobs is not supported with --remote, works with one job\n");
+        param.jobs = 1;
+    }
+
+    /* the target is read and written by the remote, here only its hashes are compared */
+    digest.path = NULL;
+    dst.open_mode = NONE;
+    param.hash_use = true;
+}
+
 void init_digest_file()
 {
     if (digest.path != NULL) {
@@ -321,6 +470,21 @@ void init_digest_file()
             }
         }
 
+        if ((digest_header.hash_type & DIGEST_TREE) && flag.digest_tree == 0)
+        {
+            fprintf(flag.prst, "Digest file: '%s' keeps its tree format\n", digest.path);
+            flag.digest_tree = 1;
+        }
+
+        if ((digest_header.hash_type & DIGEST_COARSE) && flag.digest_coarse == 0)
+        {
+            fprintf(flag.prst, "Digest file: '%s' keeps its coarse hashes\n", digest.path);
+            flag.digest_coarse = 1;
+        }
+
+        coarse_load();
+        digest_header.hash_type &= ~(DIGEST_TREE | DIGEST_COARSE);
+
         if (digest_header.hash_type != param.algo.value)
         {
             struct symbol_value_desc _algo;
@@ -368,7 +532,23 @@ void init_digest_file()
         digest.rel_off = 0;
     }
 
+    if (IS_MODE(digest.open_mode, READ))
+        checkpoint_load();
+
     digest.data_size = HEADER_SIZE + (param.num_blocks * param.algo.size);
+
+    if (flag.digest_tree == 1)
+        digest.data_size += digest_tree_size(param.num_blocks, param.block_size, param.algo.size);
+
+    if (flag.digest_coarse == 1 && (IS_MODE(digest.open_mode, PIPE) || param.block_size >= COARSE_SIZE || COARSE_SIZE % param.block_size != 0))
+    {
+        fprintf(flag.prst, "Warning: coarse hashes need a digest file and a block size smaller than %s which divides it\n",
+                format_units(COARSE_SIZE, false));
+        flag.digest_coarse = 0;
+    }
+
+    if (flag.digest_coarse == 1)
+        digest.data_size += coarse_size(src.data_size, param.algo.size);
     dev_truncate(&digest);
 
     strcpy(digest_header.recognize, MAGIC_DIGEST);
@@ -377,7 +557,10 @@ void init_digest_file()
     digest_header.block_size = param.block_size;
     digest_header.total_blocks = param.num_blocks;
     digest_header.timestamp = time(NULL);
-    digest_header.hash_type = param.algo.value;
+    digest_header.hash_type = param.algo.value | (flag.digest_tree == 1 ? DIGEST_TREE : 0);
+    digest_header.codec = 0;
+    digest_header.format = 0;
+    checkpoint_header(&digest_header);
     memset(digest_header.padding, '\0', sizeof(digest_header.padding));
 
     if (IS_MODE(digest.open_mode, MMAP))
@@ -418,7 +601,7 @@ void init_dst_delta(void)
 
     if (delta.path != NULL)
     {
-        if (access(delta.path, F_OK) == 0)
+        if (access(delta.path, F_OK) == 0 && checkpoint_delta_size() == 0)
         {
             fprintf(stderr, "%s: file exists '%s'\n", process_name, delta.path);
 
@@ -448,6 +631,11 @@ void init_dst_delta(void)
     }
 
     delta.open_mode |= WRITE;
+    delta.codec = param.codec;
+
+    /* compressed frames have variable sizes, so they are written directly */
+    if (delta.codec != CODEC_NONE && IS_MODE(delta.open_mode, MMAP))
+        delta.open_mode = (delta.open_mode & ~MMAP) | DIRECT;
 
     if (IS_MODE(delta.open_mode, MMAP))
         delta.max_buf_size = ((int)HEADER_SIZE < PAGE_SIZE ? PAGE_SIZE : (size_t)HEADER_SIZE);
@@ -458,18 +646,30 @@ void init_dst_delta(void)
         delta.buf_data = malloc(delta.max_buf_size);
     }
 
-    delta.data_size = HEADER_SIZE;
+    size_t resume_size = checkpoint_delta_size();
+
+    delta.data_size = (resume_size > 0 ? resume_size : (size_t)HEADER_SIZE);
     dev_truncate(&delta);
 
     map_buffer(&delta);
 
-    strcpy(delta_header.recognize, MAGIC_DELTA);
+    /* only deltas with a codec or extent records get the new magic, the others are readable by older versions */
+    if (delta.codec != CODEC_NONE || flag.sparse == 1)
+        param.delta_format = DELTA_EXTENTS;
+
+    if (param.delta_format == DELTA_EXTENTS)
+        strcpy(delta_header.recognize, MAGIC_DELTA2);
+    else
+        strcpy(delta_header.recognize, MAGIC_DELTA);
+
     strcpy(delta_header.version, BSF_VERSION);
     delta_header.data_size = src.data_size;
     delta_header.block_size = param.block_size;
     delta_header.total_blocks = param.num_blocks;
     delta_header.timestamp = time(NULL);
     delta_header.hash_type = 0;
+    delta_header.codec = delta.codec;
+    delta_header.format = param.delta_format;
     memset(delta_header.padding, '\0', sizeof(delta_header.padding));
 
     if (IS_MODE(delta.open_mode, MMAP_W))
@@ -498,6 +698,9 @@ void init_dst_delta(void)
 
     delta.abs_off = delta.rel_off = HEADER_SIZE;
     sync_data(&delta);
+
+    if (resume_size > 0)
+        delta.abs_off = resume_size;
 }
 
 void init_src_delta(void)
@@ -546,12 +749,42 @@ void init_src_delta(void)
     map_buffer(&delta);
     delta_read_header();
 
-    if (memcmp(delta_header.recognize, (const void *)(MAGIC_DELTA), sizeof(MAGIC_DELTA)) != 0 || delta_header.block_size < 1)
+    bool delta2 = memcmp(delta_header.recognize, (const void *)(MAGIC_DELTA2), sizeof(MAGIC_DELTA2)) == 0;
+
+    if (!delta2)
+    {
+        delta_header.codec = CODEC_NONE;
+        delta_header.format = DELTA_BLOCKS;
+    }
+
+    if ((!delta2 && memcmp(delta_header.recognize, (const void *)(MAGIC_DELTA), sizeof(MAGIC_DELTA)) != 0) ||
+        delta_header.block_size < 1 || delta_header.codec > CODEC_LZ4 || delta_header.format > DELTA_EXTENTS)
     {
         fprintf(stderr, "%s: delta data is invalid\n", process_name);
         cleanup(EXIT_FAILURE);
     }
 
+    if (!codec_supported(delta_header.codec))
+    {
+        fprintf(stderr, "%s: delta is compressed with '%s' which is not available in this build\n",
+                process_name, codec_name(delta_header.codec));
+        cleanup(EXIT_FAILURE);
+    }
+
+    if (delta_header.codec != CODEC_NONE)
+    {
+        delta.codec = delta_header.codec;
+        delta.data_size = SIZE_MAX;
+        decompress_init(&delta);
+
+        if (IS_MODE(delta.open_mode, MMAP))
+        {
+            munmap(delta.buf_data, delta.buf_size);
+            delta.open_mode = (delta.open_mode & ~MMAP) | DIRECT;
+            delta.buf_data = malloc(delta.max_buf_size);
+        }
+    }
+
     if (param.block_size != delta_header.block_size)
     {
         param.block_size = delta_header.block_size;
@@ -22,8 +22,12 @@
 void init_map_methods(void);
 void check_algo_param(void);
 void check_block_size(void);
+void check_threads(void);
+void check_jobs(void);
+void init_direct_io(struct dev *dev);
 void init_src_device(void);
 void init_dst_device(void);
+void init_remote_target(void);
 void init_digest_file(void);
 void init_dst_delta(void);
 void init_src_delta(void);
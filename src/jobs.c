@@ -0,0 +1,231 @@
+/*
+ ./src/jobs.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "jobs.h"
+#include "digest_tree.h"
+#include "sparse.h"
+#include "copy_range.h"
+#include "sectors.h"
+#include "coarse.h"
+#include "remote.h"
+#include "readahead.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+ With --jobs=N the device is split into N ranges of whole blocks and every
+ range is processed by its own process. The program state lives in the global
+ dev, oper and prog structs, so after fork() each worker simply moves src, dst
+ and digest to the start of its range and limits data_size to its end. The
+ main process takes the first range itself, then waits for the others and
+ merges their prog and summary counters, which they leave in a shared
+ anonymous mapping.
+
+ The workers run without messages, progress output and a digest tree. The tree
+ is built by the main process from the stored block hashes once all ranges are
+ done.
+*/
+
+static struct jobs
+{
+	int num_jobs;
+	int job;
+	pid_t *pids;
+	struct job_stats *stats;
+	int progress;
+	bool digest_tree;
+} jobs = {1, 0, NULL, NULL, 0, false};
+
+static void jobs_range(int job)
+{
+	/* with coarse hashes the ranges start at coarse range boundaries, so no range is split between two jobs */
+	size_t unit = flag.digest_coarse == 1 ? COARSE_SIZE / param.block_size : 1;
+	size_t first = ((param.num_blocks * job) / jobs.num_jobs / unit) * unit;
+	size_t last = (job + 1 == jobs.num_jobs ? param.num_blocks : ((param.num_blocks * (job + 1)) / jobs.num_jobs / unit) * unit);
+
+	src.abs_off = first * param.block_size;
+	src.data_size = MIN(last * param.block_size, src.data_size);
+
+	if (flag.oper_mode == BLOCKSYNC)
+	{
+		dst.abs_off = src.abs_off;
+		dst.data_size = MIN(last * param.block_size, dst.data_size);
+	}
+
+	/* the digest was mapped at the first hash, so its buffer is reloaded at the range */
+	digest.abs_off = HEADER_SIZE + first * digest.block_size;
+	digest.buf_off = 0;
+
+	oper.num_block = first;
+}
+
+void jobs_fork(void)
+{
+	if (param.jobs < 2)
+		return;
+
+	if (flag.oper_mode != BLOCKSYNC && flag.oper_mode != MAKEDIGEST)
+	{
+		fprintf(flag.prst, "Warning: --jobs is supported by block-sync and make-digest only, works with one job\n");
+		return;
+	}
+
+	if (IS_MODE(src.open_mode, PIPE) || IS_MODE(digest.open_mode, PIPE))
+	{
+		fprintf(flag.prst, "Warning: --jobs needs seekable devices, works with one job\n");
+		return;
+	}
+
+	jobs.num_jobs = (int)MIN((size_t)param.jobs, param.num_blocks);
+
+	if (jobs.num_jobs < 2)
+	{
+		jobs.num_jobs = 1;
+		return;
+	}
+
+	jobs.pids = calloc(jobs.num_jobs, sizeof(pid_t));
+	jobs.stats = mmap(NULL, jobs.num_jobs * sizeof(struct job_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (jobs.pids == NULL || jobs.stats == MAP_FAILED)
+	{
+		jobs.stats = NULL;
+		fprintf(stderr, "%s: unable to allocate memory for jobs\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	jobs.digest_tree = flag.digest_tree == 1 && param.hash_use && IS_MODE(digest.open_mode, WRITE);
+	jobs.progress = flag.progress;
+	flag.digest_tree = 0;
+	flag.progress = 0;
+
+	fprintf(flag.prst, "Jobs: %d processes over ranges of about %zu blocks\n", jobs.num_jobs, param.num_blocks / jobs.num_jobs);
+
+	fflush(flag.prst);
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 1; i < jobs.num_jobs; i++)
+	{
+		pid_t pid = fork();
+
+		if (pid < 0)
+		{
+			fprintf(stderr, "%s: unable to start job %d: %s\n", process_name, i, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		if (pid == 0)
+		{
+			jobs.job = i;
+			if (freopen("/dev/null", "w", flag.prst) == NULL)
+				cleanup(EXIT_FAILURE);
+			break;
+		}
+
+		jobs.pids[i] = pid;
+	}
+
+	jobs_range(jobs.job);
+}
+
+void jobs_finish(void)
+{
+	if (jobs.num_jobs < 2)
+		return;
+
+	if (jobs.job > 0)
+	{
+		struct job_stats *js = &jobs.stats[jobs.job];
+
+		js->wri_blocks = prog.wri_blocks;
+		js->wri_bytes = prog.wri_bytes;
+		sparse_save_stats(js);
+		copy_range_save_stats(js);
+		sectors_save_stats(js);
+		coarse_save_stats(js);
+		remote_save_stats(js);
+		readahead_save_stats(js);
+		cleanup(EXIT_SUCCESS);
+	}
+
+	bool failed = false;
+
+	for (int i = 1; i < jobs.num_jobs; i++)
+	{
+		int status = 0;
+
+		if (waitpid(jobs.pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			failed = true;
+		else
+		{
+			const struct job_stats *js = &jobs.stats[i];
+
+			prog.wri_blocks += js->wri_blocks;
+			prog.wri_bytes += js->wri_bytes;
+			sparse_merge_stats(js);
+			copy_range_merge_stats(js);
+			sectors_merge_stats(js);
+			coarse_merge_stats(js);
+			remote_merge_stats(js);
+			readahead_merge_stats(js);
+		}
+
+		jobs.pids[i] = 0;
+	}
+
+	if (failed)
+	{
+		fprintf(stderr, "%s: one of the jobs has failed\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (jobs.digest_tree)
+	{
+		flag.digest_tree = 1;
+		digest_tree_init();
+		digest_tree_rebuild(param.num_blocks);
+		digest_tree_write();
+	}
+
+	flag.progress = jobs.progress;
+	oper.num_block = param.num_blocks - 1;
+}
+
+void jobs_free(void)
+{
+	/* a failing main process stops the jobs which are still running */
+	if (jobs.job == 0 && jobs.pids != NULL)
+	{
+		for (int i = 1; i < jobs.num_jobs; i++)
+			if (jobs.pids[i] > 0)
+			{
+				kill(jobs.pids[i], SIGTERM);
+				waitpid(jobs.pids[i], NULL, 0);
+			}
+	}
+
+	if (jobs.stats != NULL)
+		munmap(jobs.stats, jobs.num_jobs * sizeof(struct job_stats));
+
+	free(jobs.pids);
+	jobs.pids = NULL;
+	jobs.stats = NULL;
+}
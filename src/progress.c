@@ -0,0 +1,274 @@
+/*
+ ./src/progress.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "progress.h"
+
+#include <signal.h>
+#include <sys/time.h>
+
+/*
+ The progress is not printed for every block. The loops only test the
+ progress_due flag, which an interval timer raises once a second, so the
+ cost per block is one load even with 512-byte blocks. The line shows the
+ percentage, the current and average throughput, the rate of changed blocks
+ and the time left. SIGUSR1 prints one status line, with or without
+ --progress, like dd does. Its handler is installed at the start of main, so
+ the signal never terminates the process, e.g. a --jobs-file batch, which
+ prints the status of its volumes instead.
+*/
+
+#define PROGRESS_INTERVAL (1)
+
+volatile sig_atomic_t progress_due = 0;
+
+static volatile sig_atomic_t progress_status = 0;
+
+static struct progress
+{
+	struct timespec start;
+	struct timespec last;
+	size_t last_bytes;
+	size_t last_blocks;
+	bool row_changed;
+	bool row_dig_mat, row_dig_wri, row_dst_mat, row_dst_wri;
+} pr;
+
+static void progress_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		progress_status = 1;
+
+	progress_due = 1;
+}
+
+/* called at the start of main, so SIGUSR1 never kills the process, also before the run starts */
+void progress_signal_init(int sa_flags)
+{
+	struct sigaction sa = {0};
+
+	sa.sa_handler = progress_signal;
+	sa.sa_flags = sa_flags;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* returns true once after every SIGUSR1 */
+bool progress_status_due(void)
+{
+	if (!progress_status)
+		return false;
+
+	progress_status = 0;
+	return true;
+}
+
+void progress_init(void)
+{
+	struct sigaction sa = {0};
+	struct itimerval timer = {{PROGRESS_INTERVAL, 0}, {PROGRESS_INTERVAL, 0}};
+
+	sa.sa_handler = progress_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	clock_gettime(CLOCK_MONOTONIC, &pr.start);
+	pr.last = pr.start;
+	pr.last_bytes = 0;
+	pr.last_blocks = 0;
+
+	if (flag.progress == 0)
+		return;
+
+	sigaction(SIGALRM, &sa, NULL);
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	/* the first row of the detailed progress is printed at the first block */
+	if (flag.progress > 1)
+		progress_due = 1;
+	else
+		fprintf(flag.prst, param.pro_form, 0.0);
+}
+
+static double progress_seconds(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static size_t progress_bytes(void)
+{
+	size_t bytes = (oper.num_block + 1) * param.block_size;
+
+	return bytes < param.data_size ? bytes : param.data_size;
+}
+
+static void progress_print_status(void)
+{
+	struct timespec now;
+	size_t bytes = progress_bytes();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	double elapsed = progress_seconds(&pr.start, &now);
+
+	if (flag.progress > 0)
+		fprintf(flag.prst, "\33[2K\r");
+
+	fprintf(flag.prst, "Status: %zu/%zu blocks, ", MIN(oper.num_block + 1, param.num_blocks), param.num_blocks);
+	fprintf(flag.prst, "%s of ", format_units(bytes, false));
+	fprintf(flag.prst, "%s, %zu changed blocks, %.1f s, ", format_units(param.data_size, false), prog.wri_blocks, elapsed);
+	fprintf(flag.prst, "%s/s\n", format_units(elapsed > 0 ? bytes / elapsed : 0, false));
+	fflush(flag.prst);
+}
+
+void print_progress(void)
+{
+	progress_due = 0;
+
+	if (progress_status_due())
+		progress_print_status();
+
+	if (flag.progress != 1)
+		return;
+
+	struct timespec now;
+	size_t bytes = progress_bytes();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	double elapsed = progress_seconds(&pr.start, &now);
+	double interval = progress_seconds(&pr.last, &now);
+	double cur_rate = interval > 0 ? (bytes - pr.last_bytes) / interval : 0;
+	double avg_rate = elapsed > 0 ? bytes / elapsed : 0;
+	double per = param.num_blocks > 0 ? floor(bytes * 100.0 / param.data_size * param.pro_fact) / param.pro_fact : 100;
+
+	fprintf(flag.prst, "\33[2K");
+	fprintf(flag.prst, param.pro_form, per);
+	fprintf(flag.prst, ", %s/s", format_units(cur_rate, false));
+	fprintf(flag.prst, ", avg %s/s, %.0f changed blocks/s", format_units(avg_rate, false),
+			interval > 0 ? (prog.wri_blocks - pr.last_blocks) / interval : 0);
+
+	if (bytes < param.data_size && avg_rate > 0)
+	{
+		size_t eta = (param.data_size - bytes) / avg_rate;
+
+		fprintf(flag.prst, ", ETA %zu:%02zu:%02zu", eta / 3600, eta / 60 % 60, eta % 60);
+	}
+
+	fflush(flag.prst);
+
+	pr.last = now;
+	pr.last_bytes = bytes;
+	pr.last_blocks = prog.wri_blocks;
+}
+
+void print_detail_progress_row(size_t cur_block, size_t num_blocks, bool dig_mat, bool dig_wri, bool dst_mat, bool dst_wri)
+{
+	bool target_write = false;
+	bool target_match = false;
+
+	if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == APPLYDELTA)
+		target_write = true;
+
+	if (flag.oper_mode == BLOCKSYNC || flag.oper_mode == MAKEDELTA)
+		target_match = true;
+
+	fprintf(flag.prst, "\33[2K\r");
+	fprintf(flag.prst, "\rBlock: %10zu/%zu"
+					   "%s"
+					   "%s"
+					   "%s"
+					   "%s",
+			cur_block,
+			num_blocks,
+			(dig_mat ? "\tDigest:Match" : ""),
+			(dig_wri ? "\tDigest:Write" : ""),
+			(dst_mat ? (target_match ? "\tTarget:Match" : "\tTarget:Seek") : ""),
+			(dst_wri ? (target_write ? "\tTarget:Write" : "\tDelta:Write") : ""));
+
+	fflush(flag.prst);
+}
+
+/*
+ The state changes of the blocks are merged into the open row, which shows
+ every state seen since it was opened. The timer refreshes the row and closes
+ it when the state changed in the meantime, so alternating blocks print one
+ row per interval instead of one per block.
+*/
+void print_detail_progress(void)
+{
+	if (prog.p_dst_wri != prog.c_dst_wri || prog.p_dig_wri != prog.c_dig_wri || prog.p_dig_mat != prog.c_dig_mat || prog.p_dst_mat != prog.c_dst_mat)
+		pr.row_changed = true;
+
+	pr.row_dig_mat |= prog.c_dig_mat;
+	pr.row_dig_wri |= prog.c_dig_wri;
+	pr.row_dst_mat |= prog.c_dst_mat;
+	pr.row_dst_wri |= prog.c_dst_wri;
+
+	prog.p_dst_wri = prog.c_dst_wri;
+	prog.p_dig_wri = prog.c_dig_wri;
+	prog.p_dig_mat = prog.c_dig_mat;
+	prog.p_dst_mat = prog.c_dst_mat;
+
+	if (progress_status_due())
+	{
+		progress_print_status();
+		progress_due = 1;
+	}
+
+	if (!progress_due)
+		return;
+
+	progress_due = 0;
+	print_detail_progress_row((oper.num_block + 1), param.num_blocks, pr.row_dig_mat, pr.row_dig_wri, pr.row_dst_mat, pr.row_dst_wri);
+
+	if (!pr.row_changed)
+		return;
+
+	/* the next row starts with the state of the current block */
+	fprintf(flag.prst, "\n");
+	pr.row_changed = false;
+	pr.row_dig_mat = prog.c_dig_mat;
+	pr.row_dig_wri = prog.c_dig_wri;
+	pr.row_dst_mat = prog.c_dst_mat;
+	pr.row_dst_wri = prog.c_dst_wri;
+}
+
+/* prints the last line of the progress at the end of the run */
+void progress_finish(void)
+{
+	struct itimerval timer = {{0, 0}, {0, 0}};
+
+	if (flag.progress == 0)
+		return;
+
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	if (flag.progress > 1)
+	{
+		print_detail_progress_row(MIN(oper.num_block + 1, param.num_blocks), param.num_blocks, pr.row_dig_mat, pr.row_dig_wri, pr.row_dst_mat, pr.row_dst_wri);
+		return;
+	}
+
+	/* the last line shows the average rate of the whole run */
+	pr.last = pr.start;
+	pr.last_bytes = 0;
+	pr.last_blocks = 0;
+	print_progress();
+}
@@ -0,0 +1,33 @@
+/*
+ ./src/progress.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <signal.h>
+
+extern volatile sig_atomic_t progress_due;
+
+void progress_signal_init(int sa_flags);
+bool progress_status_due(void);
+void progress_init(void);
+void print_progress(void);
+void print_detail_progress(void);
+void progress_finish(void);
+
+#endif
@@ -0,0 +1,511 @@
+/*
+ ./src/readahead.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "readahead.h"
+#include "sparse.h"
+#include "stats.h"
+#include "throttle.h"
+
+#include <pthread.h>
+
+/*
+ Producer/consumer ring of buffers per device. A reader thread fills the
+ slots in sequence while the main loop works on the current one, and a
+ single writer thread drains the dirty runs queued by blocksync_dev_wri_flush().
+ A slot of the src ring is refilled only after the main loop has moved past
+ it and every write pointing into it has been completed.
+*/
+
+#define RA_MAX_JOBS (256)
+
+enum slot_state
+{
+	SLOT_FREE,
+	SLOT_FILLED,
+	SLOT_IN_USE,
+	SLOT_RELEASED,
+};
+
+struct ra_slot
+{
+	char *data;
+	size_t size;
+	off_t off;
+	bool eof;
+	int refs;
+	enum slot_state state;
+};
+
+struct readahead
+{
+	struct dev *dev;
+	int num_slots;
+	struct ra_slot *slots;
+	unsigned long filled;
+	unsigned long consumed;
+	int cur;
+	off_t next_off;
+	size_t data_size;
+	int err;
+	bool running;
+	pthread_t tid;
+};
+
+struct ra_job
+{
+	struct dev *dev;
+	struct readahead *ra;
+	int slot;
+	const char *ptr;
+	size_t size;
+	off_t off;
+};
+
+static struct ra_state
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct readahead *rings[4];
+	int num_rings;
+	bool quit;
+	bool writer_running;
+	pthread_t writer_tid;
+	struct ra_job jobs[RA_MAX_JOBS];
+	unsigned long jobs_head;
+	unsigned long jobs_tail;
+	bool writing;
+	int writer_err;
+	struct dev *writer_err_dev;
+	double stall_reader;
+	double stall_compare;
+	double stall_writer;
+} ra_state = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static double ra_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ra_wait(double *stall)
+{
+	double start = ra_now();
+	pthread_cond_wait(&ra_state.cond, &ra_state.lock);
+	*stall += ra_now() - start;
+}
+
+static ssize_t ra_read(struct readahead *ra, struct ra_slot *slot, size_t size)
+{
+	size_t tbytes = 0;
+	ssize_t rbytes;
+	struct stats_clock clk;
+
+	if (sparse_hole(ra->dev, slot->off, size))
+	{
+		sparse_read(ra->dev, slot->data, slot->off, size);
+		return size;
+	}
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	throttle_io(size);
+
+	while (tbytes < size)
+	{
+		stats_begin(&clk);
+
+		if (IS_MODE(ra->dev->open_mode, PIPE_R))
+			rbytes = read(ra->dev->fd, slot->data + tbytes, size - tbytes);
+		else
+			rbytes = pread(ra->dev->fd, slot->data + tbytes, size - tbytes, slot->off + tbytes);
+
+		if (rbytes < 0 && errno == EINTR)
+			continue;
+
+		if (rbytes >= 0)
+			stats_io(ra->dev, STATS_READ, rbytes, &clk);
+
+		if (rbytes <= 0)
+			break;
+
+		tbytes += rbytes;
+
+		/* with O_DIRECT a short read only happens at the end of file */
+		if (ra->dev->dio_align > 0)
+			break;
+	}
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	return rbytes < 0 ? rbytes : (ssize_t)tbytes;
+}
+
+static void *ra_reader(void *arg)
+{
+	struct readahead *ra = (struct readahead *)arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&ra_state.lock);
+
+	while (!ra_state.quit && ra->next_off < ra->data_size)
+	{
+		struct ra_slot *slot = &ra->slots[ra->filled % ra->num_slots];
+
+		if (slot->state != SLOT_FREE)
+		{
+			ra_wait(&ra_state.stall_reader);
+			continue;
+		}
+
+		size_t size = MIN(ra->dev->max_buf_size, ra->data_size - ra->next_off);
+		slot->off = ra->next_off;
+		pthread_mutex_unlock(&ra_state.lock);
+
+		ssize_t rbytes = ra_read(ra, slot, dio_size(ra->dev, size));
+
+		if (rbytes > (ssize_t)size)
+			rbytes = size;
+
+		pthread_mutex_lock(&ra_state.lock);
+
+		if (rbytes < 0)
+		{
+			ra->err = errno;
+			pthread_cond_broadcast(&ra_state.cond);
+			break;
+		}
+
+		slot->size = rbytes;
+		slot->eof = ((size_t)rbytes < size);
+		slot->state = SLOT_FILLED;
+		ra->filled++;
+		ra->next_off += rbytes;
+
+		if (slot->eof)
+			ra->data_size = ra->next_off;
+
+		pthread_cond_broadcast(&ra_state.cond);
+	}
+
+	pthread_mutex_unlock(&ra_state.lock);
+	return NULL;
+}
+
+static void *ra_writer(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&ra_state.lock);
+
+	while (1)
+	{
+		if (ra_state.jobs_head == ra_state.jobs_tail)
+		{
+			if (ra_state.quit)
+				break;
+
+			pthread_cond_wait(&ra_state.cond, &ra_state.lock);
+			continue;
+		}
+
+		struct ra_job job = ra_state.jobs[ra_state.jobs_head % RA_MAX_JOBS];
+		ra_state.writing = true;
+		pthread_mutex_unlock(&ra_state.lock);
+
+		throttle_io(job.size);
+
+		size_t tbytes = 0;
+		ssize_t wbytes = 0;
+
+		while (tbytes < job.size && ra_state.writer_err == 0)
+		{
+			struct stats_clock clk;
+
+			stats_begin(&clk);
+			wbytes = dev_pwrite(job.dev, job.ptr + tbytes, job.size - tbytes, job.off + tbytes);
+
+			if (wbytes < 0 && errno == EINTR)
+				continue;
+
+			if (wbytes < 0)
+				break;
+
+			stats_io(job.dev, STATS_WRITE, wbytes, &clk);
+			tbytes += wbytes;
+		}
+
+		pthread_mutex_lock(&ra_state.lock);
+
+		if (wbytes < 0 && ra_state.writer_err == 0)
+		{
+			ra_state.writer_err = errno;
+			ra_state.writer_err_dev = job.dev;
+		}
+
+		if (job.ra != NULL)
+		{
+			struct ra_slot *slot = &job.ra->slots[job.slot];
+
+			if (--slot->refs == 0 && slot->state == SLOT_RELEASED)
+				slot->state = SLOT_FREE;
+		}
+
+		ra_state.jobs_head++;
+		ra_state.writing = false;
+		pthread_cond_broadcast(&ra_state.cond);
+	}
+
+	pthread_mutex_unlock(&ra_state.lock);
+	return NULL;
+}
+
+static void ra_check_errors(void)
+{
+	for (int i = 0; i < ra_state.num_rings; i++)
+	{
+		struct readahead *ra = ra_state.rings[i];
+
+		if (ra->err != 0)
+		{
+			pthread_mutex_unlock(&ra_state.lock);
+			fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name,
+					IS_MODE(ra->dev->open_mode, PIPE) ? "stdin" : ra->dev->path, strerror(ra->err));
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	if (ra_state.writer_err != 0)
+	{
+		pthread_mutex_unlock(&ra_state.lock);
+		fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, ra_state.writer_err_dev->path, strerror(ra_state.writer_err));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+void readahead_init(struct dev *dev, int num_slots)
+{
+	struct readahead *ra = calloc(1, sizeof(struct readahead));
+
+	if (ra == NULL || (ra->slots = calloc(num_slots, sizeof(struct ra_slot))) == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for read-ahead buffers\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	ra->dev = dev;
+	ra->num_slots = num_slots;
+	ra->cur = -1;
+	ra->next_off = dev->abs_off;
+	ra->data_size = dev->data_size;
+
+	for (int i = 0; i < num_slots; i++)
+	{
+		ra->slots[i].data = (i == 0 && dev->buf_data != NULL) ? dev->buf_data : alloc_buffer(dio_size(dev, dev->max_buf_size));
+
+		if (ra->slots[i].data == NULL)
+		{
+			fprintf(stderr, "%s: unable to allocate memory for read-ahead buffers\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	dev->buf_data = NULL;
+	dev->ra = ra;
+	ra_state.rings[ra_state.num_rings++] = ra;
+
+	int err = pthread_create(&ra->tid, NULL, ra_reader, ra);
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: unable to create read-ahead thread: %s\n", process_name, strerror(err));
+		cleanup(EXIT_FAILURE);
+	}
+
+	ra->running = true;
+}
+
+void readahead_next(struct dev *dev)
+{
+	struct readahead *ra = dev->ra;
+
+	pthread_mutex_lock(&ra_state.lock);
+
+	if (ra->cur >= 0)
+	{
+		struct ra_slot *prev = &ra->slots[ra->cur];
+		prev->state = (prev->refs == 0 ? SLOT_FREE : SLOT_RELEASED);
+		pthread_cond_broadcast(&ra_state.cond);
+	}
+
+	struct ra_slot *slot = &ra->slots[ra->consumed % ra->num_slots];
+
+	while (slot->state != SLOT_FILLED)
+	{
+		ra_check_errors();
+		ra_wait(&ra_state.stall_compare);
+	}
+
+	ra->cur = ra->consumed % ra->num_slots;
+	ra->consumed++;
+	slot->state = SLOT_IN_USE;
+
+	pthread_mutex_unlock(&ra_state.lock);
+
+	if (slot->off != dev->abs_off)
+	{
+		fprintf(stderr, "%s: read-ahead of '%s' is out of sync\n", process_name, dev->path);
+		cleanup(EXIT_FAILURE);
+	}
+
+	dev->buf_data = slot->data;
+	dev->buf_size = slot->size;
+
+	if (slot->eof && IS_MODE(dev->open_mode, PIPE_R))
+		dev->data_size = slot->off + slot->size;
+}
+
+void readahead_writer_init(void)
+{
+	int err = pthread_create(&ra_state.writer_tid, NULL, ra_writer, NULL);
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: unable to create writer thread: %s\n", process_name, strerror(err));
+		cleanup(EXIT_FAILURE);
+	}
+
+	ra_state.writer_running = true;
+}
+
+bool readahead_writer(void)
+{
+	return ra_state.writer_running;
+}
+
+void readahead_write(struct dev *dev, const void *ptr, size_t size, off_t off)
+{
+	pthread_mutex_lock(&ra_state.lock);
+
+	while (ra_state.jobs_tail - ra_state.jobs_head >= RA_MAX_JOBS)
+	{
+		ra_check_errors();
+		ra_wait(&ra_state.stall_writer);
+	}
+
+	ra_check_errors();
+
+	struct ra_job *job = &ra_state.jobs[ra_state.jobs_tail % RA_MAX_JOBS];
+	job->dev = dev;
+	job->ptr = (const char *)ptr;
+	job->size = size;
+	job->off = off;
+	job->ra = NULL;
+
+	/* find the ring slot the data comes from, so it is not refilled too early */
+	for (int i = 0; i < ra_state.num_rings; i++)
+	{
+		struct readahead *ra = ra_state.rings[i];
+
+		if (ra->cur >= 0 && job->ptr >= ra->slots[ra->cur].data && job->ptr < ra->slots[ra->cur].data + ra->dev->max_buf_size)
+		{
+			job->ra = ra;
+			job->slot = ra->cur;
+			ra->slots[ra->cur].refs++;
+			break;
+		}
+	}
+
+	ra_state.jobs_tail++;
+	pthread_cond_broadcast(&ra_state.cond);
+	pthread_mutex_unlock(&ra_state.lock);
+}
+
+void readahead_drain(void)
+{
+	if (!ra_state.writer_running)
+		return;
+
+	pthread_mutex_lock(&ra_state.lock);
+
+	while (ra_state.jobs_head != ra_state.jobs_tail && ra_state.writer_err == 0)
+		ra_wait(&ra_state.stall_writer);
+
+	ra_check_errors();
+	pthread_mutex_unlock(&ra_state.lock);
+}
+
+void readahead_save_stats(struct job_stats *js)
+{
+	js->stall_reader = ra_state.stall_reader;
+	js->stall_compare = ra_state.stall_compare;
+	js->stall_writer = ra_state.stall_writer;
+}
+
+void readahead_merge_stats(const struct job_stats *js)
+{
+	ra_state.stall_reader += js->stall_reader;
+	ra_state.stall_compare += js->stall_compare;
+	ra_state.stall_writer += js->stall_writer;
+}
+
+void readahead_print_stats(void)
+{
+	if (ra_state.num_rings == 0 && !ra_state.writer_running)
+		return;
+
+	fprintf(flag.prst, "Read-ahead stalls: reader %.3fs, compare %.3fs, writer %.3fs\n",
+			ra_state.stall_reader, ra_state.stall_compare, ra_state.stall_writer);
+}
+
+void readahead_free(void)
+{
+	pthread_mutex_lock(&ra_state.lock);
+	ra_state.quit = true;
+	pthread_cond_broadcast(&ra_state.cond);
+	pthread_mutex_unlock(&ra_state.lock);
+
+	if (ra_state.writer_running)
+	{
+		pthread_join(ra_state.writer_tid, NULL);
+		ra_state.writer_running = false;
+	}
+
+	for (int i = 0; i < ra_state.num_rings; i++)
+	{
+		struct readahead *ra = ra_state.rings[i];
+
+		if (ra->running)
+		{
+			pthread_cancel(ra->tid);
+			pthread_join(ra->tid, NULL);
+		}
+
+		for (int j = 1; j < ra->num_slots; j++)
+			free(ra->slots[j].data);
+
+		/* the first slot is released by freedev() like a regular buffer */
+		ra->dev->buf_data = ra->slots[0].data;
+		ra->dev->ra = NULL;
+
+		free(ra->slots);
+		free(ra);
+	}
+
+	ra_state.num_rings = 0;
+}
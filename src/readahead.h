@@ -0,0 +1,33 @@
+/*
+ ./src/readahead.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+void readahead_init(struct dev *dev, int num_slots);
+void readahead_next(struct dev *dev);
+void readahead_writer_init(void);
+bool readahead_writer(void);
+void readahead_write(struct dev *dev, const void *ptr, size_t size, off_t off);
+void readahead_drain(void);
+void readahead_save_stats(struct job_stats *js);
+void readahead_merge_stats(const struct job_stats *js);
+void readahead_print_stats(void);
+void readahead_free(void);
+
+#endif
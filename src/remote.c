@@ -0,0 +1,641 @@
+/*
+ ./src/remote.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "remote.h"
+#include "init.h"
+#include "hash_pool.h"
+#include "sparse.h"
+#include "progress.h"
+
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+ With --remote=CMD the target is handled by a second instance of the program,
+ which CMD starts with --server, e.g. 'ssh host blocksync-fast --server -d DST'.
+ Both instances talk over stdin and stdout of the server. The sender writes a
+ hello header with the size, block size and hash algorithm of the source, the
+ server opens the target, answers with its own header and streams the hashes
+ of all target blocks from a separate thread. The sender hashes its buffers,
+ compares them with the incoming hashes and sends back only the changed runs
+ of blocks as [offset][length][data] records, the same as an extents delta.
+ A record of zero length ends the stream, then the server answers with the
+ number of written bytes.
+
+ Hashes and records flow in both directions at once, so the sender compares
+ the next blocks while the server is still writing the previous ones.
+*/
+
+#define REMOTE_HASHES 1			   // the server streams the hashes of the target blocks
+#define REMOTE_PIPE_SIZE (1 << 20) // bigger pipes keep more hashes in flight
+
+static struct remote
+{
+	pid_t pid;
+	FILE *in;
+	FILE *out;
+	bool hashes;
+	size_t sent_bytes;
+	size_t recv_bytes;
+	off_t ext_off;
+	size_t ext_len;
+	const char *ext_ptr;
+	int hash_err;
+	int wake[2];
+} remote = {0, NULL, NULL, false, 0, 0, 0, 0, NULL, 0, {-1, -1}};
+
+/* reports the error which stopped the hash thread of the server */
+static void remote_hash_check(void)
+{
+	int err = __atomic_load_n(&remote.hash_err, __ATOMIC_ACQUIRE);
+
+	if (err != 0)
+	{
+		fprintf(stderr, "%s: unable to hash the target '%s': %s\n", process_name, dst.path, strerror(err));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+/* reads the unbuffered stdin of the server until the hash thread writes to the wake pipe on error */
+static size_t remote_read_wake(char *ptr, size_t size)
+{
+	struct pollfd fds[2] = {{fileno(remote.in), POLLIN, 0}, {remote.wake[0], POLLIN, 0}};
+	size_t done = 0;
+
+	while (done < size)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents != 0)
+			break;
+
+		ssize_t ret = read(fds[0].fd, ptr + done, size - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+static void remote_read(void *ptr, size_t size)
+{
+	size_t rbytes = remote.wake[0] >= 0 ? remote_read_wake((char *)ptr, size) : fread(ptr, 1, size, remote.in);
+
+	if (rbytes != size)
+	{
+		remote_hash_check();
+		fprintf(stderr, "%s: remote connection closed unexpectedly\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	remote.recv_bytes += size;
+}
+
+static void remote_write(const void *ptr, size_t size)
+{
+	if (fwrite(ptr, 1, size, remote.out) != size)
+	{
+		fprintf(stderr, "%s: unable to write to remote: %s\n", process_name, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	remote.sent_bytes += size;
+}
+
+static void remote_flush(void)
+{
+	if (fflush(remote.out) != 0)
+	{
+		fprintf(stderr, "%s: unable to write to remote: %s\n", process_name, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+}
+
+static void remote_header(struct bsf_header *header, size_t data_size, int format)
+{
+	memset(header, '\0', sizeof(struct bsf_header));
+	strcpy(header->recognize, MAGIC_REMOTE);
+	strcpy(header->version, BSF_VERSION);
+	header->data_size = data_size;
+	header->block_size = param.block_size;
+	header->total_blocks = param.num_blocks;
+	header->timestamp = time(NULL);
+	header->hash_type = param.algo.value;
+	header->format = format;
+}
+
+static bool remote_header_valid(struct bsf_header *header)
+{
+	return memcmp(header->recognize, (const void *)(MAGIC_REMOTE), sizeof(MAGIC_REMOTE)) == 0 &&
+		   header->data_size > 0 && header->block_size > 0;
+}
+
+static void remote_spawn(const char *cmd)
+{
+	int to_remote[2], from_remote[2];
+
+	if (pipe(to_remote) < 0 || pipe(from_remote) < 0)
+	{
+		fprintf(stderr, "%s: unable to create pipes for remote: %s\n", process_name, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	fflush(flag.prst);
+	fflush(stdout);
+	fflush(stderr);
+
+	remote.pid = fork();
+
+	if (remote.pid < 0)
+	{
+		fprintf(stderr, "%s: unable to start remote '%s': %s\n", process_name, cmd, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (remote.pid == 0)
+	{
+		dup2(to_remote[0], STDIN_FILENO);
+		dup2(from_remote[1], STDOUT_FILENO);
+		close(to_remote[0]);
+		close(to_remote[1]);
+		close(from_remote[0]);
+		close(from_remote[1]);
+
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		fprintf(stderr, "%s: unable to run remote '%s': %s\n", process_name, cmd, strerror(errno));
+		_exit(127);
+	}
+
+	close(to_remote[0]);
+	close(from_remote[1]);
+
+#ifdef F_SETPIPE_SZ
+	fcntl(to_remote[1], F_SETPIPE_SZ, REMOTE_PIPE_SIZE);
+	fcntl(from_remote[0], F_SETPIPE_SZ, REMOTE_PIPE_SIZE);
+#endif
+
+	remote.out = fdopen(to_remote[1], "w");
+	remote.in = fdopen(from_remote[0], "r");
+
+	if (remote.out == NULL || remote.in == NULL)
+	{
+		fprintf(stderr, "%s: unable to open pipes for remote: %s\n", process_name, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	setvbuf(remote.out, NULL, _IOFBF, REMOTE_PIPE_SIZE);
+	setvbuf(remote.in, NULL, _IOFBF, REMOTE_PIPE_SIZE);
+}
+
+/* sends the pending run of changed blocks, its data is still in the src buffer */
+static void remote_send_extent(void)
+{
+	if (remote.ext_len == 0)
+		return;
+
+	uint64_t extent[2] = {remote.ext_off, remote.ext_len};
+
+	remote_write(extent, sizeof(extent));
+	remote_write(remote.ext_ptr, remote.ext_len);
+
+	remote.ext_len = 0;
+}
+
+static void remote_add_block(void)
+{
+	if (remote.ext_len > 0 && remote.ext_ptr + remote.ext_len == src.ptr_r)
+	{
+		remote.ext_len += src.block_size;
+		return;
+	}
+
+	remote_send_extent();
+
+	remote.ext_off = src.abs_off;
+	remote.ext_ptr = src.ptr_r;
+	remote.ext_len = src.block_size;
+}
+
+void remote_sync(void)
+{
+	struct bsf_header header;
+	char *hash = malloc(2 * param.algo.size);
+	char *zero_hash = hash + param.algo.size;
+
+	if (hash == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for hashes\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	/* a closed connection is reported by remote_write() instead of killing the process */
+	signal(SIGPIPE, SIG_IGN);
+	remote_spawn(param.remote);
+
+	remote_header(&header, src.data_size, 0);
+	remote_write(&header, sizeof(header));
+	remote_flush();
+
+	remote_read(&header, sizeof(header));
+
+	if (!remote_header_valid(&header) || header.data_size != src.data_size || header.block_size != param.block_size)
+	{
+		fprintf(stderr, "%s: remote answered with an invalid header\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	remote.hashes = (header.format & REMOTE_HASHES) != 0;
+
+	if (remote.hashes)
+	{
+		fprintf(flag.prst, "Remote target exists, only changed blocks will be sent\n");
+		dst.open_mode |= READ;
+	}
+	else
+		fprintf(flag.prst, "Remote target was created, all blocks will be sent\n");
+
+	while (src.abs_off < src.data_size)
+	{
+		if ((src.abs_off + src.block_size) > src.data_size)
+			src.block_size = src.data_size % src.block_size;
+
+		if (check_buffer_reload(&src))
+		{
+			remote_send_extent();
+			map_buffer(&src);
+
+			if (remote.hashes)
+				hash_pool_run(&src);
+		}
+
+		get_ptr(&src);
+
+		bool src_zero = flag.sparse == 1 && buffer_is_zero(src.ptr_r, src.block_size);
+		bool changed = true;
+
+		if (remote.hashes)
+		{
+			remote_read(hash, param.algo.size);
+
+			if (src_zero)
+			{
+				sparse_zero_hash((void *)zero_hash, src.block_size);
+				changed = memcmp(zero_hash, hash, param.algo.size) != 0;
+			}
+			else
+				changed = memcmp(hash_pool_get(&src), hash, param.algo.size) != 0;
+		}
+		else if (src_zero)
+			changed = false; // the created target is already zeroed
+
+		prog.c_dst_wri = changed;
+		prog.c_dst_mat = !changed;
+
+		if (changed)
+		{
+			remote_add_block();
+			prog.wri_blocks++;
+			prog.wri_bytes += src.block_size;
+		}
+
+		if (flag.progress > 1)
+			print_detail_progress();
+		else if (progress_due)
+			print_progress();
+
+		src.abs_off += src.block_size;
+		src.rel_off += src.block_size;
+
+		oper.num_block++;
+	}
+
+	remote_send_extent();
+
+	uint64_t extent[2] = {0, 0};
+	uint64_t written = 0;
+
+	remote_write(extent, sizeof(extent));
+	remote_flush();
+	remote_read(&written, sizeof(written));
+
+	free(hash);
+
+	if (written != prog.wri_bytes)
+	{
+		fprintf(stderr, "%s: remote has written %zu of %zu bytes\n", process_name, (size_t)written, prog.wri_bytes);
+		cleanup(EXIT_FAILURE);
+	}
+
+	fclose(remote.out);
+	fclose(remote.in);
+	remote.out = remote.in = NULL;
+
+	int status = 0;
+
+	if (waitpid(remote.pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+	{
+		remote.pid = 0;
+		fprintf(stderr, "%s: remote '%s' has failed\n", process_name, param.remote);
+		cleanup(EXIT_FAILURE);
+	}
+
+	remote.pid = 0;
+}
+
+/*
+ Streams the hashes of the target blocks while the main thread writes the
+ received ones. On error the thread leaves errno in remote.hash_err and
+ writes once to the wake pipe, which stops the main thread waiting for
+ records the sender never sends without the hashes.
+*/
+static void *remote_hash_thread(void *arg)
+{
+	size_t buf_size = (size_t)arg;
+	char *buf = malloc(buf_size);
+	char *hashes = malloc((buf_size / param.block_size) * param.algo.size);
+	int err = 0;
+
+	if (buf == NULL || hashes == NULL)
+		err = ENOMEM;
+
+	for (size_t off = 0; err == 0 && off < dst.data_size;)
+	{
+		size_t size = MIN(buf_size, dst.data_size - off);
+		size_t rbytes = 0;
+
+		while (rbytes < size)
+		{
+			ssize_t ret = pread(dst.fd, buf + rbytes, size - rbytes, off + rbytes);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret < 0)
+			{
+				err = errno;
+				break;
+			}
+
+			if (ret == 0)
+			{
+				memset(buf + rbytes, 0, size - rbytes);
+				break;
+			}
+
+			rbytes += ret;
+		}
+
+		if (err != 0)
+			break;
+
+		hash_blocks(param.algo.value, param.algo.library, param.algo.size, hashes, buf, param.block_size, size);
+
+		size_t num_hashes = (size + param.block_size - 1) / param.block_size;
+
+		/* the sender stops reading only on error, then the main thread reports it */
+		if (fwrite(hashes, param.algo.size, num_hashes, stdout) != num_hashes)
+			break;
+
+		off += size;
+	}
+
+	fflush(stdout);
+	free(hashes);
+	free(buf);
+
+	if (err != 0)
+	{
+		__atomic_store_n(&remote.hash_err, err, __ATOMIC_RELEASE);
+
+		if (write(remote.wake[1], "", 1) < 0)
+			fprintf(stderr, "%s: unable to wake the server: %s\n", process_name, strerror(errno));
+	}
+
+	return NULL;
+}
+
+void remote_server(void)
+{
+	struct bsf_header header;
+
+	flag.prst = stderr;
+
+	if (flag.silent && freopen("/dev/null", "w", flag.prst) == NULL)
+		cleanup(EXIT_FAILURE);
+
+	fprintf(flag.prst, "Operation mode: server\n");
+
+	if (dst.path == NULL)
+	{
+		fprintf(stderr, "%s - you need to specify the target path (-d, --dst=PATH)\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	remote.in = stdin;
+	remote.out = stdout;
+
+	/* poll() on stdin only sees the data which no stdio buffer took */
+	setvbuf(remote.in, NULL, _IONBF, 0);
+
+	remote_read(&header, sizeof(header));
+
+	if (!remote_header_valid(&header))
+	{
+		fprintf(stderr, "%s: invalid request from the sender\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	for (int i = 0;; i++)
+	{
+		if (algos[i].value == 0)
+		{
+			fprintf(stderr, "%s: hash algorithm of the sender is not supported\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+
+		if (algos[i].value == (int)header.hash_type)
+		{
+			param.algo = algos[i];
+			break;
+		}
+	}
+
+	param.block_size = header.block_size;
+	param.num_blocks = header.total_blocks;
+	param.data_size = src.data_size = header.data_size;
+
+	fprintf(flag.prst, "Source device: remote has size of %s\n", format_units(src.data_size, true));
+
+	/* the received records are written with pwrite() like an extents delta */
+	dst.open_mode |= DIRECT;
+	init_dst_device();
+
+	dst.max_buf_size = param.max_buf_size;
+	adjust_buffer(&dst.max_buf_size, param.block_size);
+
+	remote.hashes = IS_MODE(dst.open_mode, READ);
+
+	remote_header(&header, dst.data_size, remote.hashes ? REMOTE_HASHES : 0);
+	remote_write(&header, sizeof(header));
+	remote_flush();
+
+	pthread_t tid;
+
+	if (remote.hashes)
+	{
+		if (pipe(remote.wake) < 0)
+		{
+			fprintf(stderr, "%s: unable to create the wake pipe of the server: %s\n", process_name, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		hash_init(param.algo.value, param.algo.library);
+
+		int err = pthread_create(&tid, NULL, remote_hash_thread, (void *)dst.max_buf_size);
+
+		if (err != 0)
+		{
+			fprintf(stderr, "%s: unable to create hashing thread: %s\n", process_name, strerror(err));
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	char *buf = malloc(dst.max_buf_size);
+	uint64_t extent[2];
+
+	if (buf == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for the buffer\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	while (1)
+	{
+		remote_hash_check();
+		remote_read(extent, sizeof(extent));
+
+		if (extent[1] == 0)
+			break;
+
+		if (extent[0] + extent[1] > dst.data_size || extent[0] % param.block_size != 0)
+		{
+			fprintf(stderr, "%s: invalid record from the sender\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+
+		prog.wri_blocks += (extent[1] + param.block_size - 1) / param.block_size;
+		prog.wri_bytes += extent[1];
+
+		while (extent[1] > 0)
+		{
+			size_t size = MIN(extent[1], dst.max_buf_size);
+
+			remote_read(buf, size);
+			applydelta_wri_extent(buf, size, extent[0]);
+
+			extent[0] += size;
+			extent[1] -= size;
+		}
+
+		oper.num_block = extent[0] / param.block_size - 1;
+		prog.c_dst_wri = true;
+
+		if (flag.progress > 1)
+			print_detail_progress();
+		else if (progress_due)
+			print_progress();
+	}
+
+	free(buf);
+
+	if (remote.hashes)
+	{
+		remote_hash_check();
+		pthread_join(tid, NULL);
+	}
+
+	if (flag.write_sync == 1)
+		fsync(dst.fd);
+
+	uint64_t written = prog.wri_bytes;
+
+	remote_write(&written, sizeof(written));
+	remote_flush();
+}
+
+void remote_save_stats(struct job_stats *js)
+{
+	js->sent_bytes = remote.sent_bytes;
+	js->recv_bytes = remote.recv_bytes;
+}
+
+void remote_merge_stats(const struct job_stats *js)
+{
+	remote.sent_bytes += js->sent_bytes;
+	remote.recv_bytes += js->recv_bytes;
+}
+
+void remote_print_stats(void)
+{
+	if (param.remote == NULL)
+		return;
+
+	fprintf(flag.prst, "Remote: sent %s, ", format_units(remote.sent_bytes, true));
+	fprintf(flag.prst, "received %s\n", format_units(remote.recv_bytes, true));
+}
+
+void remote_free(void)
+{
+	/* a failing sender stops the remote which is still running */
+	if (remote.pid <= 0)
+		return;
+
+	if (remote.out != NULL)
+		fclose(remote.out);
+
+	if (remote.in != NULL)
+		fclose(remote.in);
+
+	/* the remote sees the closed pipes and gets a moment to exit through its own cleanup */
+	pid_t done = 0;
+
+	for (int i = 0; i < 100 && (done = waitpid(remote.pid, NULL, WNOHANG)) == 0; i++)
+		usleep(10000);
+
+	if (done == 0)
+	{
+		kill(remote.pid, SIGTERM);
+		waitpid(remote.pid, NULL, 0);
+	}
+
+	remote.pid = 0;
+}
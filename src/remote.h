@@ -0,0 +1,29 @@
+/*
+ ./src/remote.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef REMOTE_H
+#define REMOTE_H
+
+void remote_sync(void);
+void remote_server(void);
+void remote_save_stats(struct job_stats *js);
+void remote_merge_stats(const struct job_stats *js);
+void remote_print_stats(void);
+void remote_free(void);
+
+#endif
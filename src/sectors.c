@@ -0,0 +1,147 @@
+/*
+ ./src/sectors.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "sectors.h"
+
+/*
+ A block which differs from the target is written by block-sync as a whole,
+ although often only a few of its sectors have changed. When the old data of
+ the target is at hand, a dirty run is narrowed to the runs of sectors which
+ differ, so the unchanged sectors are neither written nor unshared from the
+ other copies on a CoW filesystem.
+
+ Without a digest the target buffer already holds the old data. With a digest
+ the target is not read, --sector-writes=N reads only the dirty runs from it.
+*/
+
+static struct sectors
+{
+	bool active;
+	size_t size;
+	char *buf;
+	size_t dirty_bytes;
+	size_t same_bytes;
+} sec = {false, 0, NULL, 0, 0};
+
+void sectors_init(void)
+{
+	if (flag.oper_mode != BLOCKSYNC || !(IS_MODE(dst.open_mode, DIRECT_W) || IS_MODE(dst.open_mode, MMAP_W)))
+		return;
+
+	sec.size = (param.sector_size > 0 ? param.sector_size : D_SECTOR_SIZE);
+
+	if (sec.size < 512 || (sec.size & (sec.size - 1)) != 0)
+	{
+		fprintf(stderr, "%s: sector size should be a power of two of at least 512 bytes\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	/* narrower writes would go through the page cache */
+	if (IS_MODE(dst.open_mode, DIRECT) && dst.dio_align > sec.size)
+		sec.size = dst.dio_align;
+
+	if (sec.size >= param.block_size)
+		return;
+
+	if (!IS_MODE(dst.open_mode, READ))
+	{
+		if (param.sector_size == 0 || !IS_MODE(digest.open_mode, READ))
+			return;
+
+		sec.buf = alloc_buffer(src.max_buf_size);
+
+		if (sec.buf == NULL)
+		{
+			fprintf(stderr, "%s: unable to allocate memory for sector writes\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	sec.active = true;
+
+	fprintf(flag.prst, "Sector writes: only the %s sectors of changed blocks which differ from the target are written\n",
+			format_units(sec.size, false));
+}
+
+/* returns the old target data of a dirty run, or NULL when the run has to be written whole */
+const char *sectors_old(const char *buf, size_t size, off_t off)
+{
+	if (!sec.active)
+		return NULL;
+
+	if (sec.buf != NULL && pread(dst.fd, sec.buf, size, off) != (ssize_t)size)
+		return NULL;
+
+	sec.dirty_bytes += size;
+
+	return (sec.buf != NULL ? sec.buf : buf);
+}
+
+static size_t sectors_len(off_t off, size_t left)
+{
+	return MIN(left, sec.size - off % sec.size);
+}
+
+/* skips the sectors from *pos on which equal the old data and returns the length of the run of changed ones after them */
+size_t sectors_dirty_run(const char *ptr, const char *old, off_t off, size_t size, size_t *pos)
+{
+	if (old == NULL)
+		return size - *pos;
+
+	size_t start = *pos;
+
+	while (*pos < size && memcmp(ptr + *pos, old + *pos, sectors_len(off + *pos, size - *pos)) == 0)
+		*pos += sectors_len(off + *pos, size - *pos);
+
+	sec.same_bytes += *pos - start;
+
+	size_t end = *pos;
+
+	while (end < size && memcmp(ptr + end, old + end, sectors_len(off + end, size - end)) != 0)
+		end += sectors_len(off + end, size - end);
+
+	return end - *pos;
+}
+
+void sectors_save_stats(struct job_stats *js)
+{
+	js->sector_dirty_bytes = sec.dirty_bytes;
+	js->sector_same_bytes = sec.same_bytes;
+}
+
+void sectors_merge_stats(const struct job_stats *js)
+{
+	sec.dirty_bytes += js->sector_dirty_bytes;
+	sec.same_bytes += js->sector_same_bytes;
+}
+
+void sectors_print_stats(void)
+{
+	if (!sec.active || sec.dirty_bytes == 0)
+		return;
+
+	fprintf(flag.prst, "Sector writes: %s of changed blocks ", format_units(sec.same_bytes, false));
+	fprintf(flag.prst, "out of %s were unchanged sectors and not written\n", format_units(sec.dirty_bytes, false));
+}
+
+void sectors_free(void)
+{
+	free(sec.buf);
+	memset(&sec, 0, sizeof(sec));
+}
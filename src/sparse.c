@@ -0,0 +1,311 @@
+/*
+ ./src/sparse.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "sparse.h"
+#include "compare.h"
+#include "stats.h"
+
+#include <linux/falloc.h> // FALLOC_FL_PUNCH_HOLE
+#include <linux/fs.h>	  // BLKZEROOUT
+
+/*
+ Holes of a regular src file are found with SEEK_DATA/SEEK_HOLE and are not
+ read at all, only the data extents of a loaded buffer are read and the rest
+ of it is cleared. All-zero blocks of the dst are not written with data,
+ contiguous runs of them are punched out of a regular file or zeroed out on
+ a block device. When neither works the zeros are written. A delta stores
+ runs of zero blocks as zero extents without data, apply-delta punches them
+ out of the target the same way.
+*/
+
+#define ZERO_PAGE_SIZE (64 * 1024)
+
+static char zero_page[ZERO_PAGE_SIZE] __attribute__((aligned(4096)));
+
+static struct sparse
+{
+	struct dev *src;
+	struct dev *dst;
+	off_t data_off;
+	off_t hole_off;
+	off_t zero_off;
+	size_t zero_size;
+	char *zero_buf;
+	size_t zero_buf_size;
+	char *zero_hash;
+	size_t zero_hash_size;
+	bool no_punch;
+	size_t hole_bytes;
+	size_t zero_blocks;
+	off_t seek_off;
+} sparse = {NULL, NULL, -1, -1, 0, 0, NULL, 0, NULL, 0, false, 0, 0, 0};
+
+void sparse_init(void)
+{
+	if ((flag.oper_mode == BLOCKSYNC || flag.oper_mode == MAKEDELTA || flag.oper_mode == MAKEDIGEST) &&
+		!IS_MODE(src.open_mode, PIPE) && S_ISREG(src.stat.st_mode))
+		sparse.src = &src;
+
+	if ((flag.oper_mode == BLOCKSYNC || (flag.oper_mode == APPLYDELTA && !IS_MODE(dst.open_mode, MMAP))) &&
+		(S_ISREG(dst.stat.st_mode) || S_ISBLK(dst.stat.st_mode)))
+		sparse.dst = &dst;
+
+	sparse.zero_buf_size = MAX(param.block_size, param.max_buf_size);
+	sparse.zero_buf = alloc_buffer(sparse.zero_buf_size);
+	sparse.zero_hash = malloc(MAX(param.algo.size, 1));
+
+	if (sparse.zero_buf == NULL || sparse.zero_hash == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate memory for sparse mode\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	memset(sparse.zero_buf, 0, sparse.zero_buf_size);
+
+	if (flag.oper_mode == APPLYDELTA)
+		fprintf(flag.prst, "Sparse: %s\n", sparse.dst != NULL ? "punches zero extents out of the target" : "zero extents are written as usual");
+	else
+		fprintf(flag.prst, "Sparse: %s, %s\n",
+				sparse.src != NULL ? "skips reading holes of the source" : "detects zero blocks of the source",
+				sparse.dst != NULL ? "punches zero blocks out of the target" : "target is written as usual");
+}
+
+/* finds the data extent [data_off, hole_off) at or after off */
+static bool sparse_extent(struct dev *dev, off_t off)
+{
+	/* the cached extent and the hole before it cover most calls of a sequential scan */
+	if (off >= sparse.seek_off && off < sparse.hole_off)
+		return true;
+
+	sparse.seek_off = off;
+	sparse.data_off = lseek(dev->fd, off, SEEK_DATA);
+
+	if (sparse.data_off < 0)
+	{
+		/* ENXIO means there is no more data up to the end of file */
+		if (errno != ENXIO)
+		{
+			sparse.src = NULL;
+			return false;
+		}
+
+		sparse.data_off = sparse.hole_off = dev->data_size;
+	}
+	else
+	{
+		sparse.hole_off = lseek(dev->fd, sparse.data_off, SEEK_HOLE);
+
+		if (sparse.hole_off < 0)
+			sparse.hole_off = dev->data_size;
+	}
+
+	return true;
+}
+
+/* tells whether a buffer of the src has holes, a buffer without them is read as usual */
+bool sparse_hole(struct dev *dev, off_t off, size_t size)
+{
+	if (dev != sparse.src || !sparse_extent(dev, off))
+		return false;
+
+	return sparse.data_off > off || sparse.hole_off < off + (off_t)size;
+}
+
+/* loads a buffer of the src with holes, they are cleared and only the data extents are read */
+void sparse_read(struct dev *dev, char *buf, off_t off, size_t size)
+{
+	for (off_t pos = off, end = off + size; pos < end;)
+	{
+		if (!sparse_extent(dev, pos))
+		{
+			fprintf(stderr, "%s: error while seeking in '%s' : %s\n", process_name, dev->path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		/* the rounded up end of an O_DIRECT buffer is past the end of file */
+		if (pos >= (off_t)dev->data_size)
+		{
+			memset(buf + (pos - off), 0, end - pos);
+			break;
+		}
+
+		if (pos < sparse.data_off)
+		{
+			size_t hole = MIN(sparse.data_off, end) - pos;
+
+			memset(buf + (pos - off), 0, hole);
+			sparse.hole_bytes += hole;
+			pos += hole;
+			continue;
+		}
+
+		size_t data = MIN(sparse.hole_off, end) - pos;
+		off_t read_off = pos;
+
+		/* O_DIRECT reads whole aligned units, a unit which is partly a hole is read with its data */
+		if (dev->dio_align > 0)
+			read_off -= read_off % dev->dio_align;
+
+		struct stats_clock clk;
+
+		stats_begin(&clk);
+
+		ssize_t rbytes = pread(dev->fd, buf + (read_off - off), dio_size(dev, (pos - read_off) + data), read_off);
+
+		if (rbytes < 0)
+		{
+			fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name, dev->path, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		stats_io(dev, STATS_READ, rbytes, &clk);
+
+		pos += data;
+	}
+}
+
+/* compares the buffer with a zero page on the SIMD kernels of the compare module */
+bool buffer_is_zero(const void *buf, size_t size)
+{
+	for (size_t pos = 0; pos < size; pos += ZERO_PAGE_SIZE)
+		if (!compare_equal((const char *)buf + pos, zero_page, MIN(size - pos, (size_t)ZERO_PAGE_SIZE)))
+			return false;
+
+	return true;
+}
+
+void sparse_zero_hash(void *out, size_t size)
+{
+	if (size != sparse.zero_hash_size)
+	{
+		hash_buffer(param.algo.value, param.algo.library, param.algo.size, sparse.zero_hash, sparse.zero_buf, size);
+		sparse.zero_hash_size = size;
+	}
+
+	memcpy(out, sparse.zero_hash, param.algo.size);
+}
+
+static bool sparse_punch(struct dev *dev, off_t off, size_t size)
+{
+	if (sparse.no_punch)
+		return false;
+
+	if (fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, size) == 0)
+		return true;
+
+	if (S_ISBLK(dev->stat.st_mode))
+	{
+		uint64_t range[2] = {off, size};
+
+		if (ioctl(dev->fd, BLKZEROOUT, &range) == 0)
+			return true;
+	}
+
+	fprintf(flag.prst, "Warning: unable to punch holes in '%s' (%s), writes zeros instead\n", dev->path, strerror(errno));
+	sparse.no_punch = true;
+
+	return false;
+}
+
+void sparse_flush(void)
+{
+	if (sparse.zero_size == 0)
+		return;
+
+	if (!BIT_SET(flag.dont_write, 1) && !sparse_punch(sparse.dst, sparse.zero_off, sparse.zero_size))
+	{
+		for (size_t done = 0; done < sparse.zero_size;)
+		{
+			size_t size = MIN(sparse.zero_buf_size, sparse.zero_size - done);
+
+			if (dev_pwrite(sparse.dst, sparse.zero_buf, size, sparse.zero_off + done) < 0)
+			{
+				fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, sparse.dst->path, strerror(errno));
+				cleanup(EXIT_FAILURE);
+			}
+
+			done += size;
+		}
+	}
+
+	sparse.zero_size = 0;
+}
+
+bool sparse_zero(struct dev *dev, off_t off, size_t size)
+{
+	if (dev != sparse.dst)
+		return false;
+
+	if (sparse.zero_size > 0 && sparse.zero_off + (off_t)sparse.zero_size != off)
+		sparse_flush();
+
+	if (sparse.zero_size == 0)
+		sparse.zero_off = off;
+
+	sparse.zero_size += size;
+	sparse.zero_blocks += (size + param.block_size - 1) / param.block_size;
+
+	return true;
+}
+
+/* writes a zero extent of a delta, it is punched out of the target with --sparse */
+void sparse_apply_zero(off_t off, size_t size)
+{
+	if (BIT_SET(flag.dont_write, 0))
+		return;
+
+	if (sparse_zero(&dst, off, size))
+		return;
+
+	for (size_t done = 0; done < size; done += ZERO_PAGE_SIZE)
+		applydelta_wri_extent(zero_page, MIN(size - done, (size_t)ZERO_PAGE_SIZE), off + done);
+}
+
+void sparse_save_stats(struct job_stats *js)
+{
+	js->hole_bytes = sparse.hole_bytes;
+	js->zero_blocks = sparse.zero_blocks;
+}
+
+void sparse_merge_stats(const struct job_stats *js)
+{
+	sparse.hole_bytes += js->hole_bytes;
+	sparse.zero_blocks += js->zero_blocks;
+}
+
+void sparse_print_stats(void)
+{
+	if (flag.sparse == 0)
+		return;
+
+	fprintf(flag.prst, "Sparse: %s of holes not read, %zu zero blocks not written\n",
+			format_units(sparse.hole_bytes, false), sparse.zero_blocks);
+}
+
+void sparse_free(void)
+{
+	if (sparse.zero_buf != NULL)
+		free(sparse.zero_buf);
+
+	if (sparse.zero_hash != NULL)
+		free(sparse.zero_hash);
+
+	sparse.zero_buf = NULL;
+	sparse.zero_hash = NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ ./src/sparse.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+void sparse_init(void);
+bool sparse_hole(struct dev *dev, off_t off, size_t size);
+void sparse_read(struct dev *dev, char *buf, off_t off, size_t size);
+bool buffer_is_zero(const void *buf, size_t size);
+void sparse_zero_hash(void *out, size_t size);
+bool sparse_zero(struct dev *dev, off_t off, size_t size);
+void sparse_flush(void);
+void sparse_apply_zero(off_t off, size_t size);
+void sparse_save_stats(struct job_stats *js);
+void sparse_merge_stats(const struct job_stats *js);
+void sparse_print_stats(void);
+void sparse_free(void);
+
+#endif
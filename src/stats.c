@@ -0,0 +1,453 @@
+/*
+ ./src/stats.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "stats.h"
+#include "uring.h"
+
+#include <sys/resource.h>
+
+/*
+ With --stats=json[:FILE] the time spent in every phase of a run is summed
+ per loaded buffer or flushed run, never per block: reads of map_buffer(),
+ hashing of the pool, the compare step, writes of the flush functions and
+ fsyncs of sync_data(). The CPU time is of the whole process, so the hash
+ threads count in the phase the main loop waits in, and the read-ahead
+ threads in the phase it runs at the time. The counters live in shared
+ memory, so --jobs processes and --jobs-file volumes add up in one report.
+
+ Every read, write and fsync call of a device is also recorded in a latency
+ histogram, with --stats or --latency. The buckets are logarithmic with
+ 2^LATENCY_SUB_BITS linear sub-buckets per power of two, like an HDR
+ histogram, so a bucket is found with one count of leading zeros and the
+ error of a percentile stays below 1/16 of the value at any scale. The
+ counts are added atomically, without a lock.
+*/
+
+#define LATENCY_SUB_BITS (4)
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+#define LATENCY_OPS (3)
+
+struct stats_phase
+{
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+};
+
+struct stats_dev
+{
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+	uint64_t syncs;
+};
+
+struct stats_latency
+{
+	uint64_t buckets[LATENCY_BUCKETS];
+	uint64_t calls;
+	uint64_t max_ns;
+};
+
+struct stats_shared
+{
+	struct stats_phase phases[STATS_PHASES];
+	struct stats_dev devs[4];
+	struct stats_latency latency[4][LATENCY_OPS];
+};
+
+static struct stats
+{
+	bool active;
+	const char *path;
+	struct timespec start;
+	struct stats_shared *shared;
+} st = {false, NULL, {0, 0}, NULL};
+
+static const char *phase_names[STATS_PHASES] = {"read", "hash", "compare", "write", "sync"};
+static const char *dev_names[] = {"src", "dst", "digest", "delta"};
+static const char *op_names[LATENCY_OPS] = {"read", "write", "sync"};
+
+void stats_init(void)
+{
+	if (param.stats == NULL && param.latency == 0)
+		return;
+
+	if (param.stats != NULL && (strncmp(param.stats, "json", 4) != 0 || (param.stats[4] != '\0' && param.stats[4] != ':')))
+	{
+		fprintf(stderr, "%s: unsupported stats format '%s', only json[:FILE] is supported\n", process_name, param.stats);
+		cleanup(EXIT_FAILURE);
+	}
+
+	if (param.stats != NULL && param.stats[4] == ':')
+		st.path = param.stats + 5;
+	else if (param.stats != NULL)
+	{
+		/* the JSON goes to stdout, unless stdout already carries the output of the operation */
+		if ((flag.oper_mode == MAKEDELTA && delta.path == NULL) || (flag.oper_mode == MAKEDIGEST && digest.path == NULL) ||
+			flag.oper_mode == COMPAREDIGESTS || flag.server == 1)
+		{
+			fprintf(stderr, "%s: stdout is used by the operation, use --stats=json:FILE\n", process_name);
+			cleanup(EXIT_FAILURE);
+		}
+
+		/* the summary is printed to stderr, so stdout holds the JSON only, --silent must not close either of them */
+		flag.prst = flag.silent ? fopen("/dev/null", "w") : stderr;
+
+		if (flag.prst == NULL)
+		{
+			fprintf(stderr, "%s: unable to open /dev/null: %s\n", process_name, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+	}
+
+	st.shared = mmap(NULL, sizeof(struct stats_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (st.shared == MAP_FAILED)
+	{
+		st.shared = NULL;
+		fprintf(stderr, "%s: unable to allocate memory for stats\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &st.start);
+	st.active = true;
+}
+
+void stats_begin(struct stats_clock *clk)
+{
+	if (!st.active)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &clk->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &clk->cpu);
+}
+
+static uint64_t stats_ns(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+void stats_end(struct stats_clock *clk, enum stats_phases phase, size_t bytes)
+{
+	if (!st.active)
+		return;
+
+	struct timespec wall, cpu;
+	struct stats_phase *ph = &st.shared->phases[phase];
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+	__atomic_add_fetch(&ph->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ph->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ph->wall_ns, stats_ns(&clk->wall, &wall), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ph->cpu_ns, stats_ns(&clk->cpu, &cpu), __ATOMIC_RELAXED);
+}
+
+static size_t stats_bucket(uint64_t ns)
+{
+	if (ns < LATENCY_SUB_COUNT)
+		return ns;
+
+	int exp = 63 - __builtin_clzll(ns);
+
+	return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT + ((ns >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1));
+}
+
+static uint64_t stats_bucket_low(size_t i)
+{
+	if (i < LATENCY_SUB_COUNT)
+		return i;
+
+	int exp = i / LATENCY_SUB_COUNT + LATENCY_SUB_BITS - 1;
+
+	return (uint64_t)(LATENCY_SUB_COUNT + i % LATENCY_SUB_COUNT) << (exp - LATENCY_SUB_BITS);
+}
+
+static uint64_t stats_bucket_high(size_t i)
+{
+	if (i < LATENCY_SUB_COUNT)
+		return i;
+
+	return stats_bucket_low(i) + ((uint64_t)1 << (i / LATENCY_SUB_COUNT - 1)) - 1;
+}
+
+/* counts one read, write or fsync call of a device, which started at the clock */
+void stats_io(struct dev *dev, enum stats_phases phase, size_t bytes, struct stats_clock *clk)
+{
+	if (!st.active)
+		return;
+
+	struct timespec now;
+	int d = (dev == &src ? 0 : dev == &dst ? 1 : dev == &digest ? 2 : 3);
+	struct stats_dev *sd = &st.shared->devs[d];
+	struct stats_latency *lat = &st.shared->latency[d][phase == STATS_READ ? 0 : phase == STATS_WRITE ? 1 : 2];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t ns = stats_ns(&clk->wall, &now);
+	uint64_t max_ns = __atomic_load_n(&lat->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&lat->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&lat->calls, 1, __ATOMIC_RELAXED);
+
+	while (ns > max_ns && !__atomic_compare_exchange_n(&lat->max_ns, &max_ns, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	if (phase == STATS_READ)
+	{
+		__atomic_add_fetch(&sd->reads, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sd->read_bytes, bytes, __ATOMIC_RELAXED);
+	}
+	else if (phase == STATS_WRITE)
+	{
+		__atomic_add_fetch(&sd->writes, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sd->write_bytes, bytes, __ATOMIC_RELAXED);
+	}
+	else if (phase == STATS_SYNC)
+		__atomic_add_fetch(&sd->syncs, 1, __ATOMIC_RELAXED);
+}
+
+static void stats_print_string(FILE *out, const char *str)
+{
+	if (str == NULL)
+	{
+		fprintf(out, "null");
+		return;
+	}
+
+	fputc('"', out);
+
+	for (; *str != '\0'; str++)
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+
+	fputc('"', out);
+}
+
+static double stats_seconds(uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+static double stats_timeval(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* returns the upper bound of the bucket which holds the given fraction of the calls */
+static uint64_t stats_percentile(struct stats_latency *lat, double fraction)
+{
+	uint64_t rank = (uint64_t)(fraction * lat->calls + 0.999999);
+	uint64_t count = 0;
+
+	for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+		if ((count += lat->buckets[i]) >= rank && count > 0)
+			return MIN(stats_bucket_high(i), lat->max_ns);
+
+	return lat->max_ns;
+}
+
+static const char *stats_format_ns(uint64_t ns, char *buf)
+{
+	if (ns >= 1000000000)
+		sprintf(buf, "%.2f s", ns / 1e9);
+	else if (ns >= 1000000)
+		sprintf(buf, "%.2f ms", ns / 1e6);
+	else
+		sprintf(buf, "%.2f us", ns / 1e3);
+
+	return buf;
+}
+
+static void stats_print_latency(void)
+{
+	char p50[32], p99[32], p999[32], max[32];
+
+	for (int d = 0; d < 4; d++)
+		for (int op = 0; op < LATENCY_OPS; op++)
+		{
+			struct stats_latency *lat = &st.shared->latency[d][op];
+
+			if (lat->calls == 0)
+				continue;
+
+			fprintf(flag.prst, "Latency of %s %ss: %lu calls, p50 %s, p99 %s, p99.9 %s, max %s\n", dev_names[d], op_names[op], lat->calls,
+					stats_format_ns(stats_percentile(lat, 0.5), p50), stats_format_ns(stats_percentile(lat, 0.99), p99),
+					stats_format_ns(stats_percentile(lat, 0.999), p999), stats_format_ns(lat->max_ns, max));
+
+			if (param.latency < 2)
+				continue;
+
+			for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+				if (lat->buckets[i] > 0)
+					fprintf(flag.prst, "  %lu-%lu ns: %lu\n", stats_bucket_low(i), stats_bucket_high(i), lat->buckets[i]);
+		}
+}
+
+static void stats_print_json_latency(FILE *out)
+{
+	fprintf(out, "  \"latency\": {");
+
+	for (int d = 0, first_dev = 1; d < 4; d++)
+	{
+		int first_op = 1;
+
+		for (int op = 0; op < LATENCY_OPS; op++)
+		{
+			struct stats_latency *lat = &st.shared->latency[d][op];
+
+			if (lat->calls == 0)
+				continue;
+
+			if (first_op)
+				fprintf(out, "%s\n    \"%s\": {", first_dev ? "" : ",", dev_names[d]);
+
+			fprintf(out, "%s\n      \"%s\": {\"calls\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu",
+					first_op ? "" : ",", op_names[op], lat->calls, stats_percentile(lat, 0.5), stats_percentile(lat, 0.99),
+					stats_percentile(lat, 0.999), lat->max_ns);
+
+			if (param.latency > 1)
+			{
+				fprintf(out, ", \"buckets\": [");
+
+				for (size_t i = 0, first = 1; i < LATENCY_BUCKETS; i++)
+					if (lat->buckets[i] > 0)
+					{
+						fprintf(out, "%s[%lu, %lu, %lu]", first ? "" : ", ", stats_bucket_low(i), stats_bucket_high(i), lat->buckets[i]);
+						first = 0;
+					}
+
+				fprintf(out, "]");
+			}
+
+			fprintf(out, "}");
+			first_op = 0;
+			first_dev = 0;
+		}
+
+		if (!first_op)
+			fprintf(out, "\n    }");
+	}
+
+	fprintf(out, "\n  },\n");
+}
+
+void stats_print(void)
+{
+	if (!st.active)
+		return;
+
+	/* io_uring requests are counted when they complete */
+	uring_wait();
+
+	if (param.latency > 0)
+		stats_print_latency();
+
+	if (param.stats == NULL)
+		return;
+
+	static const char *mode_names[] = {"block-sync", "benchmark", "digest-info", "delta-info", "make-delta", "apply-delta", "make-digest", "compare-digests"};
+	const char *dev_paths[] = {src.path, dst.path, digest.path, delta.path};
+	struct timespec now;
+	struct rusage self, children;
+	FILE *out = stdout;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	if (st.path != NULL && (out = fopen(st.path, "w")) == NULL)
+	{
+		fprintf(stderr, "%s: unable to write stats to '%s': %s\n", process_name, st.path, strerror(errno));
+		return;
+	}
+
+	fprintf(out, "{\n  \"mode\": \"%s\",\n", mode_names[flag.oper_mode]);
+	fprintf(out, "  \"wall_time\": %.6f,\n", stats_seconds(stats_ns(&st.start, &now)));
+	fprintf(out, "  \"cpu_time\": {\"user\": %.6f, \"system\": %.6f},\n",
+			stats_timeval(&self.ru_utime) + stats_timeval(&children.ru_utime),
+			stats_timeval(&self.ru_stime) + stats_timeval(&children.ru_stime));
+	fprintf(out, "  \"blocks\": %zu,\n  \"written_blocks\": %zu,\n", param.num_blocks, prog.wri_blocks);
+	fprintf(out, "  \"data_size\": %zu,\n  \"written_bytes\": %zu,\n", param.data_size, prog.wri_bytes);
+
+	/* the blocks which were not written matched their stored hashes */
+	if (IS_MODE(digest.open_mode, READ) && param.num_blocks > 0)
+		fprintf(out, "  \"digest_match_ratio\": %.6f,\n", (double)(param.num_blocks - MIN(prog.wri_blocks, param.num_blocks)) / param.num_blocks);
+	else
+		fprintf(out, "  \"digest_match_ratio\": null,\n");
+
+	fprintf(out, "  \"phases\": {\n");
+
+	for (int i = 0; i < STATS_PHASES; i++)
+	{
+		struct stats_phase *ph = &st.shared->phases[i];
+
+		fprintf(out, "    \"%s\": {\"calls\": %lu, \"bytes\": %lu, \"wall_time\": %.6f, \"cpu_time\": %.6f, \"mib_per_s\": ",
+				phase_names[i], ph->calls, ph->bytes, stats_seconds(ph->wall_ns), stats_seconds(ph->cpu_ns));
+
+		if (ph->wall_ns > 0 && ph->bytes > 0)
+			fprintf(out, "%.2f}", ph->bytes / 1048576.0 / stats_seconds(ph->wall_ns));
+		else
+			fprintf(out, "null}");
+
+		fprintf(out, "%s\n", i < STATS_PHASES - 1 ? "," : "");
+	}
+
+	fprintf(out, "  },\n");
+	stats_print_json_latency(out);
+	fprintf(out, "  \"devices\": {\n");
+
+	for (int i = 0, first = 1; i < 4; i++)
+	{
+		struct stats_dev *sd = &st.shared->devs[i];
+
+		if (dev_paths[i] == NULL && sd->reads == 0 && sd->writes == 0)
+			continue;
+
+		fprintf(out, "%s    \"%s\": {\"path\": ", first ? "" : ",\n", dev_names[i]);
+		stats_print_string(out, dev_paths[i]);
+		fprintf(out, ", \"reads\": %lu, \"read_bytes\": %lu, \"writes\": %lu, \"write_bytes\": %lu, \"syncs\": %lu}",
+				sd->reads, sd->read_bytes, sd->writes, sd->write_bytes, sd->syncs);
+		first = 0;
+	}
+
+	fprintf(out, "\n  }\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+	else
+		fflush(out);
+}
+
+void stats_free(void)
+{
+	if (st.shared != NULL)
+		munmap(st.shared, sizeof(struct stats_shared));
+
+	memset(&st, 0, sizeof(st));
+}
@@ -0,0 +1,45 @@
+/*
+ ./src/stats.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+enum stats_phases
+{
+	STATS_READ,
+	STATS_HASH,
+	STATS_COMPARE,
+	STATS_WRITE,
+	STATS_SYNC,
+	STATS_PHASES,
+};
+
+struct stats_clock
+{
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+void stats_init(void);
+void stats_begin(struct stats_clock *clk);
+void stats_end(struct stats_clock *clk, enum stats_phases phase, size_t bytes);
+void stats_io(struct dev *dev, enum stats_phases phase, size_t bytes, struct stats_clock *clk);
+void stats_print(void);
+void stats_free(void);
+
+#endif
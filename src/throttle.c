@@ -0,0 +1,116 @@
+/*
+ ./src/throttle.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "throttle.h"
+
+/*
+ --max-rate and --max-iops pace every buffer load and every write to the
+ target. Each I/O reserves its share of time on a virtual clock and sleeps
+ until the reserved slot begins. The clocks live in a shared anonymous mapping
+ which is created before any fork(), so the limits are global to all jobs and
+ batch volumes, not per process. With --read-ahead the reader and writer threads
+ reserve the slots of the I/O they issue.
+*/
+
+static struct throttle_clock
+{
+	uint64_t rate_next;
+	uint64_t iops_next;
+} *clock_state = NULL;
+
+static size_t max_rate = 0;
+static int max_iops = 0;
+
+static uint64_t throttle_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* returns the start of the slot of the given length reserved on the clock */
+static uint64_t throttle_reserve(uint64_t *next, uint64_t now, uint64_t cost)
+{
+	uint64_t old = __atomic_load_n(next, __ATOMIC_RELAXED);
+	uint64_t start;
+
+	do
+		start = MAX(old, now);
+	while (!__atomic_compare_exchange_n(next, &old, start + cost, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return start;
+}
+
+void throttle_init(size_t rate, int iops)
+{
+	if (rate == 0 && iops <= 0)
+		return;
+
+	clock_state = mmap(NULL, sizeof(struct throttle_clock), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (clock_state == MAP_FAILED)
+	{
+		clock_state = NULL;
+		fprintf(stderr, "%s: unable to allocate memory for the I/O limits\n", process_name);
+		cleanup(EXIT_FAILURE);
+	}
+
+	clock_state->rate_next = clock_state->iops_next = 0;
+	max_rate = rate;
+	max_iops = iops;
+}
+
+void throttle_io(size_t size)
+{
+	if (clock_state == NULL || size == 0)
+		return;
+
+	uint64_t now = throttle_now();
+	uint64_t start = now;
+	uint64_t slot;
+
+	if (max_rate > 0)
+	{
+		slot = throttle_reserve(&clock_state->rate_next, now, (uint64_t)((double)size * 1e9 / max_rate));
+		start = MAX(start, slot);
+	}
+
+	if (max_iops > 0)
+	{
+		slot = throttle_reserve(&clock_state->iops_next, now, 1000000000ULL / max_iops);
+		start = MAX(start, slot);
+	}
+
+	if (start > now)
+	{
+		struct timespec ts = {(time_t)((start - now) / 1000000000ULL), (long)((start - now) % 1000000000ULL)};
+
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+}
+
+void throttle_free(void)
+{
+	if (clock_state != NULL)
+		munmap(clock_state, sizeof(struct throttle_clock));
+
+	clock_state = NULL;
+}
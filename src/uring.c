@@ -0,0 +1,359 @@
+/*
+ ./src/uring.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "uring.h"
+#include "stats.h"
+
+/*
+ Minimal io_uring backend built directly on the kernel interface.
+ Every read or write is split into chunks which are queued together,
+ so a single buffer keeps up to param.queue_depth requests in flight.
+ Writes are not waited for: they complete while the main loop works on
+ the rest of the buffer and are reaped before any buffer is reloaded.
+ The reads of the src and dst buffers are queued together and waited for
+ once, so both devices work at the same time.
+*/
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+#define URING_MIN_CHUNK (64 * 1024)
+
+struct uring_req
+{
+	struct dev *dev;
+	char *ptr;
+	size_t size;
+	off_t off;
+	int opcode;
+	struct stats_clock clk;
+};
+
+static struct uring
+{
+	int fd;
+	unsigned int depth;
+	unsigned int inflight;
+	unsigned int writes;
+	bool failed;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct uring_req *reqs;
+	unsigned int *free_reqs;
+	unsigned int num_free;
+	unsigned int to_submit;
+} ring = {-1};
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	int ret;
+
+	do
+		ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+	while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+bool uring_init(unsigned int depth)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring.fd = syscall(__NR_io_uring_setup, depth, &p);
+
+	if (ring.fd < 0)
+		return false;
+
+	ring.depth = p.sq_entries;
+	ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.sq_size = ring.cq_size = MAX(ring.sq_size, ring.cq_size);
+
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+
+	if (ring.sq_ptr == MAP_FAILED)
+		return false;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.cq_ptr = ring.sq_ptr;
+	else
+	{
+		ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+
+		if (ring.cq_ptr == MAP_FAILED)
+			return false;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+	if (ring.sqes == MAP_FAILED)
+		return false;
+
+	ring.sq_head = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+
+	ring.reqs = calloc(ring.depth, sizeof(struct uring_req));
+	ring.free_reqs = calloc(ring.depth, sizeof(unsigned int));
+
+	if (ring.reqs == NULL || ring.free_reqs == NULL)
+		return false;
+
+	for (unsigned int i = 0; i < ring.depth; i++)
+		ring.free_reqs[i] = i;
+
+	ring.num_free = ring.depth;
+
+	return true;
+}
+
+static void uring_fail(struct uring_req *req, int err)
+{
+	ring.failed = true;
+
+	fprintf(stderr, "%s: error while %s '%s' : %s\n", process_name,
+			req->opcode == IORING_OP_READ ? "reading from" : "writing to", req->dev->path, strerror(err));
+	cleanup(EXIT_FAILURE);
+}
+
+static void uring_complete(struct uring_req *req, int res)
+{
+	enum stats_phases phase = req->opcode == IORING_OP_READ ? STATS_READ : STATS_WRITE;
+
+	if (res < 0)
+		uring_fail(req, -res);
+
+	stats_io(req->dev, phase, res, &req->clk);
+
+	/* finish short transfers synchronously, only a read which reaches the end of the device may stay short */
+	while ((size_t)res < req->size)
+	{
+		if (req->opcode == IORING_OP_READ && req->off + res >= (off_t)req->dev->data_size)
+			break;
+
+		/* with O_DIRECT a short read before the end of the device can not be continued unaligned */
+		if (res == 0 || (req->opcode == IORING_OP_READ && req->dev->dio_align > 0))
+			uring_fail(req, EIO);
+
+		req->ptr += res;
+		req->size -= res;
+		req->off += res;
+
+		stats_begin(&req->clk);
+
+		if (req->opcode == IORING_OP_READ)
+			res = pread(req->dev->fd, req->ptr, req->size, req->off);
+		else
+			res = pwrite(req->dev->fd, req->ptr, req->size, req->off);
+
+		if (res < 0)
+			uring_fail(req, errno);
+
+		stats_io(req->dev, phase, res, &req->clk);
+	}
+}
+
+static void uring_reap(unsigned int min_complete)
+{
+	if (ring.to_submit > 0 || min_complete > 0)
+	{
+		int ret = uring_enter(ring.to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+		if (ret < 0)
+		{
+			ring.failed = true;
+			fprintf(stderr, "%s: io_uring_enter() error : %s\n", process_name, strerror(errno));
+			cleanup(EXIT_FAILURE);
+		}
+
+		ring.to_submit -= MIN((unsigned int)ret, ring.to_submit);
+	}
+
+	unsigned int head = *ring.cq_head;
+	unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail)
+	{
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		unsigned int idx = (unsigned int)cqe->user_data;
+		int res = cqe->res;
+
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		ring.free_reqs[ring.num_free++] = idx;
+		ring.inflight--;
+
+		if (ring.reqs[idx].opcode == IORING_OP_WRITE)
+			ring.writes--;
+
+		uring_complete(&ring.reqs[idx], res);
+	}
+}
+
+static void uring_queue(int opcode, struct dev *dev, char *ptr, size_t size, off_t off)
+{
+	while (ring.num_free == 0)
+		uring_reap(1);
+
+	unsigned int idx = ring.free_reqs[--ring.num_free];
+	struct uring_req *req = &ring.reqs[idx];
+
+	req->dev = dev;
+	req->ptr = ptr;
+	req->size = size;
+	req->off = off;
+	req->opcode = opcode;
+	stats_begin(&req->clk);
+
+	unsigned int tail = *ring.sq_tail;
+	unsigned int sidx = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[sidx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = dev->fd;
+	sqe->addr = (unsigned long)ptr;
+	sqe->len = size;
+	sqe->off = off;
+	sqe->user_data = idx;
+
+	ring.sq_array[sidx] = sidx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring.to_submit++;
+	ring.inflight++;
+
+	if (opcode == IORING_OP_WRITE)
+		ring.writes++;
+}
+
+static void uring_submit(int opcode, struct dev *dev, char *buf, size_t size, off_t off)
+{
+	size_t chunk = MAX(size / ring.depth, (size_t)URING_MIN_CHUNK);
+	chunk = ((chunk + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+
+	for (size_t pos = 0; pos < size; pos += chunk)
+		uring_queue(opcode, dev, buf + pos, MIN(chunk, size - pos), off + pos);
+
+	uring_reap(0);
+}
+
+void uring_read(struct dev *dev, void *buf, size_t size, off_t off)
+{
+	uring_submit(IORING_OP_READ, dev, (char *)buf, size, off);
+}
+
+void uring_write(struct dev *dev, const void *buf, size_t size, off_t off)
+{
+	uring_submit(IORING_OP_WRITE, dev, (char *)buf, size, off);
+}
+
+void uring_wait(void)
+{
+	if (ring.fd < 0 || ring.failed)
+		return;
+
+	while (ring.inflight > 0)
+		uring_reap(1);
+}
+
+/* waits for the writes only, the reads which are queued stay in flight */
+void uring_wait_writes(void)
+{
+	if (ring.fd < 0 || ring.failed)
+		return;
+
+	while (ring.writes > 0)
+		uring_reap(1);
+}
+
+void uring_free(void)
+{
+	if (ring.fd < 0)
+		return;
+
+	uring_wait();
+
+	if (ring.sqes != NULL && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.depth * sizeof(struct io_uring_sqe));
+
+	if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_size);
+
+	if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED)
+		munmap(ring.sq_ptr, ring.sq_size);
+
+	free(ring.reqs);
+	free(ring.free_reqs);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+#else
+
+bool uring_init(unsigned int depth)
+{
+	(void)depth;
+	errno = ENOSYS;
+	return false;
+}
+
+void uring_read(struct dev *dev, void *buf, size_t size, off_t off)
+{
+	(void)dev;
+	(void)buf;
+	(void)size;
+	(void)off;
+}
+
+void uring_write(struct dev *dev, const void *buf, size_t size, off_t off)
+{
+	(void)dev;
+	(void)buf;
+	(void)size;
+	(void)off;
+}
+
+void uring_wait(void)
+{
+}
+
+void uring_wait_writes(void)
+{
+}
+
+void uring_free(void)
+{
+}
+
+#endif
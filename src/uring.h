@@ -0,0 +1,29 @@
+/*
+ ./src/uring.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+bool uring_init(unsigned int depth);
+void uring_read(struct dev *dev, void *buf, size_t size, off_t off);
+void uring_write(struct dev *dev, const void *buf, size_t size, off_t off);
+void uring_wait(void);
+void uring_wait_writes(void);
+void uring_free(void);
+
+#endif
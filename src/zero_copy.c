@@ -0,0 +1,189 @@
+/*
+ ./src/zero_copy.c - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+	http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "globals.h"
+#include "zero_copy.h"
+#include "stats.h"
+
+/*
+ An extent delta read from a regular file or a pipe is not loaded into the
+ delta buffer. Only the extent headers are read, the payload is moved by the
+ kernel with copy_file_range() from a file or splice() from a pipe straight
+ to the dst. When the kernel refuses, e.g. across file systems or for a block
+ device, the remaining payload goes through the delta buffer as before.
+*/
+
+static struct zero_copy
+{
+	bool active;
+	bool kernel;
+	size_t kernel_bytes;
+	size_t buffered_bytes;
+	size_t unsynced;
+} zc = {false, false, 0, 0, 0};
+
+bool zero_copy_init(void)
+{
+	zc.active = delta_header.format == DELTA_EXTENTS && delta.codec == CODEC_NONE &&
+				(IS_MODE(delta.open_mode, DIRECT_R) || IS_MODE(delta.open_mode, PIPE_R)) &&
+				IS_MODE(dst.open_mode, DIRECT_W) && !IS_MODE(dst.open_mode, URING) && !BIT_SET(flag.dont_write, 0);
+	zc.kernel = zc.active;
+
+	if (zc.active)
+		fprintf(flag.prst, "Applies delta payload with %s\n", IS_MODE(delta.open_mode, PIPE) ? "splice" : "copy_file_range");
+
+	return zc.active;
+}
+
+bool zero_copy_active(void)
+{
+	return zc.active;
+}
+
+static ssize_t delta_read(void *buf, size_t size)
+{
+	ssize_t rbytes;
+	struct stats_clock clk;
+
+	do
+	{
+		stats_begin(&clk);
+
+		if (IS_MODE(delta.open_mode, PIPE))
+			rbytes = read(delta.fd, buf, size);
+		else
+			rbytes = pread(delta.fd, buf, size, delta.abs_off);
+	} while (rbytes < 0 && errno == EINTR);
+
+	if (rbytes < 0)
+	{
+		fprintf(stderr, "%s: error while reading from '%s' : %s\n", process_name,
+				IS_MODE(delta.open_mode, PIPE) ? "stdin" : delta.path, strerror(errno));
+		cleanup(EXIT_FAILURE);
+	}
+
+	stats_io(&delta, STATS_READ, rbytes, &clk);
+	delta.abs_off += rbytes;
+
+	return rbytes;
+}
+
+static void delta_truncated(void)
+{
+	fprintf(stderr, "%s: delta data is invalid\n", process_name);
+	cleanup(EXIT_FAILURE);
+}
+
+bool zero_copy_read(void *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t rbytes = delta_read((char *)buf + done, size - done);
+
+		if (rbytes == 0 && done == 0)
+			return false;
+
+		if (rbytes == 0)
+			delta_truncated();
+
+		done += rbytes;
+	}
+
+	return true;
+}
+
+static ssize_t kernel_copy(off_t *off, size_t size)
+{
+	if (IS_MODE(delta.open_mode, PIPE))
+		return splice(delta.fd, NULL, dst.fd, off, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+	off_t delta_off = delta.abs_off;
+
+	return copy_file_range(delta.fd, &delta_off, dst.fd, off, size, 0);
+}
+
+void zero_copy_write(off_t off, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t wbytes = 0;
+
+		if (zc.kernel)
+		{
+			off_t dst_off = off;
+			struct stats_clock clk;
+
+			stats_begin(&clk);
+			wbytes = kernel_copy(&dst_off, size);
+
+			if (wbytes < 0 && errno == EINTR)
+				continue;
+
+			if (wbytes < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+			{
+				fprintf(flag.prst, "Warning: kernel copy of delta payload is not possible (%s), uses buffered writes\n", strerror(errno));
+				zc.kernel = false;
+				continue;
+			}
+
+			if (wbytes < 0)
+			{
+				fprintf(stderr, "%s: error while writing to '%s' : %s\n", process_name, dst.path, strerror(errno));
+				cleanup(EXIT_FAILURE);
+			}
+
+			if (wbytes == 0)
+				delta_truncated();
+
+			delta.abs_off += wbytes;
+			zc.kernel_bytes += wbytes;
+
+			stats_end(&clk, STATS_WRITE, wbytes);
+			stats_io(&dst, STATS_WRITE, wbytes, &clk);
+		}
+		else
+		{
+			wbytes = delta_read(delta.buf_data, MIN(size, delta.max_buf_size));
+
+			if (wbytes == 0)
+				delta_truncated();
+
+			applydelta_wri_extent(delta.buf_data, wbytes, off);
+			zc.buffered_bytes += wbytes;
+		}
+
+		off += wbytes;
+		size -= wbytes;
+		zc.unsynced += wbytes;
+
+		if (zc.unsynced >= dst.max_buf_size)
+		{
+			sync_data(&dst);
+			zc.unsynced = 0;
+		}
+	}
+}
+
+void zero_copy_print_stats(void)
+{
+	if (zc.active)
+		fprintf(flag.prst, "Zero-copy: %s moved by the kernel, %s through the buffer\n",
+				format_units(zc.kernel_bytes, false), format_units(zc.buffered_bytes, false));
+}
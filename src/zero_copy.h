@@ -0,0 +1,28 @@
+/*
+ ./src/zero_copy.h - this file is a part of program blocksync-fast
+
+ Copyright (C) 2024 Marcin Koczwara <mk@nethorizon.pl>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef ZERO_COPY_H
+#define ZERO_COPY_H
+
+bool zero_copy_init(void);
+bool zero_copy_active(void);
+bool zero_copy_read(void *buf, size_t size);
+void zero_copy_write(off_t off, size_t size);
+void zero_copy_print_stats(void);
+
+#endif